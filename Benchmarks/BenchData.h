@@ -0,0 +1,156 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+// Deterministic English-like text, so every run and every stage sees the same bytes
+inline vector<unsigned char> makeText(size_t size, uint32_t seed = 203) {
+    static const char* WORDS[] = {
+            "the", "bee", "movie", "honey", "flower", "pollen", "jar", "you", "like", "jazz", "a", "of", "and",
+            "to", "is", "in", "that", "it", "was", "for", "on", "are", "with", "as", "be", "at", "this", "have",
+            "from", "or", "one", "had", "by", "word", "but", "not", "what", "all", "were", "we", "when", "your",
+            "can", "said", "there", "use", "an", "each", "which", "she", "do", "how", "their", "if", "will"
+    };
+    const size_t WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+    mt19937 rng(seed);
+    vector<unsigned char> text;
+    text.reserve(size + 16);
+    while (text.size() < size) {
+        const char* word = WORDS[rng() % WORD_COUNT];
+        text.insert(text.end(), word, word + char_traits<char>::length(word));
+        text.push_back(rng() % 12 == 0 ? '\n' : ' ');
+    }
+    text.resize(size);
+    return text;
+}
+
+// Web-server style access log lines, lots of repeated structure with varying fields
+inline vector<unsigned char> makeLogs(size_t size, uint32_t seed = 203) {
+    static const char* PATHS[] = {"/index.html", "/api/v1/users", "/api/v1/orders", "/static/app.js", "/login", "/favicon.ico"};
+    static const char* METHODS[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    static const int STATUS[] = {200, 200, 200, 304, 404, 500};
+    mt19937 rng(seed);
+    vector<unsigned char> logs;
+    logs.reserve(size + 256);
+    unsigned long timestamp = 1700000000;
+    char line[256];
+    while (logs.size() < size) {
+        // Draw every field in a fixed order, argument evaluation order isn't specified
+        timestamp += rng() % 3;
+        unsigned subnet = rng() % 8, host = rng() % 256, method = rng() % 6, path = rng() % 6, status = rng() % 6, bytes = rng() % 50000;
+        int n = snprintf(line, sizeof(line), "10.0.%u.%u - - [%lu] \"%s %s HTTP/1.1\" %d %u \"-\" \"Mozilla/5.0\"\n",
+                         subnet, host, timestamp, METHODS[method], PATHS[path], STATUS[status], bytes);
+        logs.insert(logs.end(), line, line + n);
+    }
+    logs.resize(size);
+    return logs;
+}
+
+// Array of JSON records with fixed keys and mixed values
+inline vector<unsigned char> makeJson(size_t size, uint32_t seed = 203) {
+    static const char* NAMES[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+    mt19937 rng(seed);
+    vector<unsigned char> json(1, '[');
+    json.reserve(size + 256);
+    char record[256];
+    for (unsigned id = 0; json.size() < size; ++id) {
+        unsigned name = rng() % 8, score = rng() % 100000, active = rng() % 2, tag1 = rng() % 20, tag2 = rng() % 20;
+        int n = snprintf(record, sizeof(record), "%s{\"id\":%u,\"name\":\"%s\",\"score\":%.3f,\"active\":%s,\"tags\":[\"t%u\",\"t%u\"]}",
+                         id ? ",\n" : "\n", id, NAMES[name], score / 1000.0, active ? "true" : "false", tag1, tag2);
+        json.insert(json.end(), record, record + n);
+    }
+    json.resize(size);
+    return json;
+}
+
+// C++-like source: indented blocks built from a small vocabulary of statements
+inline vector<unsigned char> makeSource(size_t size, uint32_t seed = 203) {
+    static const char* STATEMENTS[] = {
+            "int i = 0;", "for (size_t j = 0; j < input.size(); ++j) {", "if (node == nullptr) return;",
+            "output.push_back(byte);", "}", "return result;", "uint16_t offset = token.offset;",
+            "// Move the window", "while (k < limit && input[candidate + k] == input[pos + k]) {", "k++;"
+    };
+    mt19937 rng(seed);
+    vector<unsigned char> source;
+    source.reserve(size + 128);
+    int depth = 0;
+    for (unsigned function = 0; source.size() < size; ++function) {
+        string header = "void function" + to_string(function) + "(const vector<unsigned char>& input) {\n";
+        source.insert(source.end(), header.begin(), header.end());
+        depth = 1;
+        for (unsigned line = rng() % 20 + 5; line > 0; --line) {
+            const char* statement = STATEMENTS[rng() % 10];
+            source.insert(source.end(), depth * 4, ' ');
+            source.insert(source.end(), statement, statement + char_traits<char>::length(statement));
+            source.push_back('\n');
+        }
+        source.insert(source.end(), {'}', '\n', '\n'});
+    }
+    source.resize(size);
+    return source;
+}
+
+// Machine-code-like bytes: a small set of frequent opcodes, little endian immediates and zero padding
+inline vector<unsigned char> makeBinary(size_t size, uint32_t seed = 203) {
+    static const unsigned char OPCODES[] = {0x48, 0x89, 0x8b, 0xe8, 0xc3, 0x55, 0x5d, 0x83, 0xff, 0x0f, 0x85, 0x74};
+    mt19937 rng(seed);
+    vector<unsigned char> binary;
+    binary.reserve(size + 16);
+    while (binary.size() < size) {
+        uint32_t kind = rng() % 10;
+        if (kind < 6) {
+            binary.push_back(OPCODES[rng() % sizeof(OPCODES)]);
+        } else if (kind < 9) {
+            uint32_t immediate = 0x401000 + (rng() % 4096) * 16;
+            for (int i = 0; i < 4; ++i) binary.push_back((immediate >> (8 * i)) & 0xFF);
+        } else {
+            binary.insert(binary.end(), rng() % 16, 0);
+        }
+    }
+    binary.resize(size);
+    return binary;
+}
+
+// Uniform random bytes, effectively incompressible
+inline vector<unsigned char> makeRandom(size_t size, uint32_t seed = 203) {
+    mt19937 rng(seed);
+    vector<unsigned char> data(size);
+    for (auto& byte : data) byte = static_cast<unsigned char>(rng());
+    return data;
+}
+
+// A short phrase repeated with the odd mutation
+inline vector<unsigned char> makeRepetitive(size_t size, uint32_t seed = 203) {
+    static const char PHRASE[] = "According to all known laws of aviation, there is no way a bee should be able to fly. ";
+    mt19937 rng(seed);
+    vector<unsigned char> data;
+    data.reserve(size + sizeof(PHRASE));
+    while (data.size() < size) {
+        data.insert(data.end(), PHRASE, PHRASE + sizeof(PHRASE) - 1);
+        if (rng() % 64 == 0) {
+            size_t pos = data.size() - 1 - rng() % 10;
+            data[pos] = 'A' + rng() % 26;
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+static const char* CORPUS_CLASSES[] = {"text", "logs", "json", "source", "binary", "random", "repetitive"};
+
+inline vector<unsigned char> makeCorpus(const string& name, size_t size) {
+    if (name == "text") return makeText(size);
+    if (name == "logs") return makeLogs(size);
+    if (name == "json") return makeJson(size);
+    if (name == "source") return makeSource(size);
+    if (name == "binary") return makeBinary(size);
+    if (name == "random") return makeRandom(size);
+    if (name == "repetitive") return makeRepetitive(size);
+    throw std::invalid_argument("Unknown corpus class: " + name);
+}
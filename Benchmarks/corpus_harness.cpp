@@ -0,0 +1,242 @@
+// Runs every algorithm and level over a corpus of data classes and sizes, and prints a
+// ratio x compress MB/s x decompress MB/s matrix as CSV and/or JSON
+// With --baseline it compares against a stored CSV and exits non-zero on a regression. It also compresses each class
+// as a batch of small messages and fails if a shared table compressBatch registers isn't used by any of them
+//
+// corpus_harness [--sizes 1K,64K,1M] [--classes text,logs,...] [--file path]... [--levels 1,6,9,10] [--legacy]
+//                [--csv out.csv] [--json out.json] [--baseline baseline.csv] [--ratio-tolerance 0.01]
+//                [--check-speed] [--speed-tolerance 0.25]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <map>
+#include "LZ77/LZ77.h"
+#include "Deflate/Deflate.h"
+#include "BenchData.h"
+
+using namespace std;
+
+struct CorpusResult {
+    string corpus;
+    size_t size;
+    string algorithm;
+    double ratio;
+    double compressMBps;
+    double decompressMBps;
+};
+
+struct Algorithm {
+    string name;
+    CompressionParams params;
+    size_t maxSize; // The quadratic finders are skipped above this
+};
+
+static size_t parseSize(const string& text) {
+    size_t value = stoull(text);
+    switch (text.back()) {
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        case 'G': case 'g': return value << 30;
+        default: return value;
+    }
+}
+
+static vector<string> split(const string& text, char separator) {
+    vector<string> parts;
+    stringstream stream(text);
+    string part;
+    while (getline(stream, part, separator)) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+// Best of several runs, at least one and until 0.1s has been spent
+template <typename F>
+static double bestSeconds(F run) {
+    double best = 1e300, total = 0;
+    for (int i = 0; i < 5 && (i == 0 || total < 0.1); ++i) {
+        auto start = chrono::steady_clock::now();
+        run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, seconds);
+        total += seconds;
+    }
+    return max(best, 1e-9);
+}
+
+static map<string, CorpusResult> loadBaseline(const string& path) {
+    map<string, CorpusResult> baseline;
+    ifstream file(path);
+    string line;
+    getline(file, line); // Header
+    while (getline(file, line)) {
+        vector<string> fields = split(line, ',');
+        if (fields.size() < 6) continue;
+        CorpusResult result = {fields[0], stoull(fields[1]), fields[2], stod(fields[3]), stod(fields[4]), stod(fields[5])};
+        baseline[result.corpus + "/" + fields[1] + "/" + result.algorithm] = result;
+    }
+    return baseline;
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes = {1 << 10, 64 << 10, 1 << 20};
+    vector<string> classes(CORPUS_CLASSES, CORPUS_CLASSES + sizeof(CORPUS_CLASSES) / sizeof(CORPUS_CLASSES[0]));
+    vector<string> files;
+    vector<int> levels;
+    for (int level = CompressionParams::MIN_LEVEL; level <= CompressionParams::ULTRA_LEVEL; ++level) levels.push_back(level);
+    bool legacy = false, checkSpeed = false;
+    string csvPath, jsonPath, baselinePath;
+    double ratioTolerance = 0.01, speedTolerance = 0.25;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--sizes") { sizes.clear(); for (const string& s : split(value, ',')) sizes.push_back(parseSize(s)); ++i; }
+        else if (arg == "--classes") { classes = split(value, ','); ++i; }
+        else if (arg == "--file") { files.push_back(value); ++i; }
+        else if (arg == "--levels") { levels.clear(); for (const string& s : split(value, ',')) levels.push_back(stoi(s)); ++i; }
+        else if (arg == "--legacy") legacy = true;
+        else if (arg == "--csv") { csvPath = value; ++i; }
+        else if (arg == "--json") { jsonPath = value; ++i; }
+        else if (arg == "--baseline") { baselinePath = value; ++i; }
+        else if (arg == "--ratio-tolerance") { ratioTolerance = stod(value); ++i; }
+        else if (arg == "--speed-tolerance") { speedTolerance = stod(value); ++i; }
+        else if (arg == "--check-speed") checkSpeed = true;
+        else {
+            cout << "Unknown argument: " << arg << endl;
+            return 2;
+        }
+    }
+
+    vector<Algorithm> algorithms;
+    for (int level : levels) {
+        string name = level == CompressionParams::ULTRA_LEVEL ? "ultra" : "level" + to_string(level);
+        algorithms.push_back({name, CompressionParams::fromLevel(level), SIZE_MAX});
+    }
+    if (legacy) {
+        const pair<const char*, MatchFinder> LEGACY[] = {
+                {"bruteforce", MatchFinder::BruteForce}, {"deque", MatchFinder::Deque}, {"rabinkarp", MatchFinder::RabinKarp}
+        };
+        for (const auto& finder : LEGACY) {
+            CompressionParams params;
+            params.matchFinder = finder.second;
+            params.windowSize = 4096;
+            algorithms.push_back({finder.first, params, 64 << 10});
+        }
+    }
+
+    // Generated classes at every size, plus any real files as they are
+    vector<pair<string, vector<unsigned char>>> corpus;
+    try {
+        for (const string& name : classes) {
+            for (size_t size : sizes) corpus.push_back(make_pair(name, makeCorpus(name, size)));
+        }
+    } catch (const std::invalid_argument& e) {
+        cout << e.what() << endl;
+        return 2;
+    }
+    LZ77 lz;
+    for (const string& path : files) {
+        corpus.push_back(make_pair(path.substr(path.find_last_of("/\\") + 1), lz.loadFile(path)));
+    }
+
+    vector<CorpusResult> results;
+    bool failed = false;
+    Deflate deflate;
+    for (const auto& entry : corpus) {
+        const vector<unsigned char>& input = entry.second;
+        for (const Algorithm& algorithm : algorithms) {
+            if (input.size() > algorithm.maxSize) continue;
+            vector<unsigned char> compressed, decompressed;
+            double compressSeconds = bestSeconds([&]() { compressed = deflate.compress(input, algorithm.params); });
+            double decompressSeconds = bestSeconds([&]() { decompressed = deflate.decompress(compressed); });
+            if (decompressed != input) {
+                cout << "ROUND TRIP FAILED: " << entry.first << " " << input.size() << " " << algorithm.name << endl;
+                failed = true;
+            }
+            double megabytes = input.size() / 1e6;
+            results.push_back({entry.first, input.size(), algorithm.name, double(input.size()) / compressed.size(),
+                               megabytes / compressSeconds, megabytes / decompressSeconds});
+            const CorpusResult& r = results.back();
+            cout << r.corpus << "\t" << r.size << "\t" << r.algorithm << "\tratio " << r.ratio
+                 << "\tcompress " << r.compressMBps << " MB/s\tdecompress " << r.decompressMBps << " MB/s" << endl;
+        }
+    }
+
+    // compressBatch with a shared table over each class cut into small messages. A table it registers has to show up
+    // in the outputs, as the table id byte after the flags of their one block
+    const unsigned char BATCH_TABLE_ID = 0x40;
+    const size_t BATCH_MESSAGES = 256, BATCH_MESSAGE_SIZE = 1 << 10;
+    for (const string& name : classes) {
+        vector<unsigned char> data = makeCorpus(name, BATCH_MESSAGES * BATCH_MESSAGE_SIZE);
+        vector<ByteSpan> spans;
+        for (size_t i = 0; i < BATCH_MESSAGES; ++i) spans.push_back(ByteSpan{data.data() + i * BATCH_MESSAGE_SIZE, BATCH_MESSAGE_SIZE});
+        CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+        Deflate::BatchResult batch = deflate.compressBatch(spans, params, BATCH_TABLE_ID);
+        size_t batchBytes = 0, singleBytes = 0, usingTable = 0;
+        for (size_t i = 0; i < BATCH_MESSAGES; ++i) {
+            const vector<unsigned char>& output = batch.outputs[i];
+            batchBytes += output.size();
+            singleBytes += deflate.compress(vector<unsigned char>(spans[i].data, spans[i].data + spans[i].size), params).size();
+            if (output.size() > 22 && !(output[21] & Deflate::STORED_FLAG) && output[22] == BATCH_TABLE_ID) ++usingTable;
+            vector<ByteSpan> one = {ByteSpan{output.data(), output.size()}};
+            if (deflate.decompressBatch(one)[0] != vector<unsigned char>(spans[i].data, spans[i].data + spans[i].size)) {
+                cout << "ROUND TRIP FAILED: batch " << name << " message " << i << endl;
+                failed = true;
+            }
+        }
+        cout << "batch " << name << "\t" << BATCH_MESSAGES << " x " << BATCH_MESSAGE_SIZE << "\ttable " << (batch.table ? "registered" : "none")
+             << "\tused by " << usingTable << "\tratio " << double(data.size()) / batchBytes << " vs " << double(data.size()) / singleBytes
+             << " one by one" << endl;
+        if (batch.table && usingTable == 0) {
+            cout << "BATCH TABLE UNUSED: " << name << endl;
+            failed = true;
+        }
+        if (batch.table) Huffman::unregisterTable(BATCH_TABLE_ID);
+    }
+
+    if (!csvPath.empty()) {
+        ofstream csv(csvPath);
+        csv << "corpus,size,algorithm,ratio,compress_mbps,decompress_mbps\n";
+        for (const CorpusResult& r : results) {
+            csv << r.corpus << "," << r.size << "," << r.algorithm << "," << r.ratio << "," << r.compressMBps << "," << r.decompressMBps << "\n";
+        }
+    }
+    if (!jsonPath.empty()) {
+        ofstream json(jsonPath);
+        json << "[\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const CorpusResult& r = results[i];
+            json << "  {\"corpus\": \"" << r.corpus << "\", \"size\": " << r.size << ", \"algorithm\": \"" << r.algorithm
+                 << "\", \"ratio\": " << r.ratio << ", \"compress_mbps\": " << r.compressMBps
+                 << ", \"decompress_mbps\": " << r.decompressMBps << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        json << "]\n";
+    }
+
+    if (!baselinePath.empty()) {
+        // Ratios are deterministic and always checked, speeds only on request since they depend on the machine
+        map<string, CorpusResult> baseline = loadBaseline(baselinePath);
+        for (const CorpusResult& r : results) {
+            auto it = baseline.find(r.corpus + "/" + to_string(r.size) + "/" + r.algorithm);
+            if (it == baseline.end()) continue;
+            const CorpusResult& b = it->second;
+            if (r.ratio < b.ratio * (1 - ratioTolerance)) {
+                cout << "REGRESSION ratio " << r.corpus << " " << r.size << " " << r.algorithm << ": " << r.ratio << " < " << b.ratio << endl;
+                failed = true;
+            }
+            if (checkSpeed && r.compressMBps < b.compressMBps * (1 - speedTolerance)) {
+                cout << "REGRESSION compress " << r.corpus << " " << r.size << " " << r.algorithm << ": " << r.compressMBps << " < " << b.compressMBps << " MB/s" << endl;
+                failed = true;
+            }
+            if (checkSpeed && r.decompressMBps < b.decompressMBps * (1 - speedTolerance)) {
+                cout << "REGRESSION decompress " << r.corpus << " " << r.size << " " << r.algorithm << ": " << r.decompressMBps << " < " << b.decompressMBps << " MB/s" << endl;
+                failed = true;
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
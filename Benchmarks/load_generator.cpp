@@ -0,0 +1,103 @@
+// Load generator for deflated: concurrent clients, each on its own connection, send requests back to back and
+// the run reports throughput and latency percentiles
+//
+// load_generator --socket path [--clients 8] [--requests 1000] [--size 4K] [--class text] [--level 6] [--decompress]
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "Deflate/Deflate.h"
+#include "Server/Client.h"
+#include "BenchData.h"
+
+using namespace std;
+
+static size_t parseSize(const string& text) {
+    size_t value = stoull(text);
+    switch (text.back()) {
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        default: return value;
+    }
+}
+
+int main(int argc, char** argv) {
+    string socketPath, corpusClass = "text";
+    int clients = 8, level = CompressionParams::DEFAULT_LEVEL;
+    size_t requests = 1000, size = 4 << 10;
+    bool decompress = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--socket") { socketPath = value; ++i; }
+        else if (arg == "--clients") { clients = max(1, stoi(value)); ++i; }
+        else if (arg == "--requests") { requests = stoull(value); ++i; }
+        else if (arg == "--size") { size = parseSize(value); ++i; }
+        else if (arg == "--class") { corpusClass = value; ++i; }
+        else if (arg == "--level") { level = stoi(value); ++i; }
+        else if (arg == "--decompress") decompress = true;
+        else {
+            cout << "Unknown argument: " << arg << endl;
+            return 2;
+        }
+    }
+    if (socketPath.empty()) {
+        cout << "usage: load_generator --socket path [--clients n] [--requests n] [--size n] [--class name] [--level n] [--decompress]" << endl;
+        return 2;
+    }
+
+    vector<unsigned char> original;
+    try {
+        original = makeCorpus(corpusClass, size);
+    } catch (const std::invalid_argument& e) {
+        cout << e.what() << endl;
+        return 2;
+    }
+    Deflate deflate;
+    const vector<unsigned char> payload = decompress ? deflate.compress(original, level) : original;
+
+    vector<vector<double>> latencies(clients);
+    vector<string> failures(clients);
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c]() {
+            try {
+                Client client(socketPath);
+                latencies[c].reserve(requests);
+                for (size_t r = 0; r < requests; ++r) {
+                    auto sent = chrono::steady_clock::now();
+                    vector<unsigned char> output = decompress ? client.decompress(payload.data(), payload.size())
+                                                              : client.compress(payload.data(), payload.size(), level);
+                    latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+                    // The first response of each client is checked, the rest only timed
+                    if (r == 0 && (decompress ? output : Deflate().decompress(output)) != original) throw std::runtime_error("Wrong response");
+                }
+            } catch (const std::exception& e) {
+                failures[c] = e.what();
+            }
+        });
+    }
+    for (thread& t : threads) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    bool failed = false;
+    for (int c = 0; c < clients; ++c) {
+        if (failures[c].empty()) continue;
+        cout << "client " << c << ": " << failures[c] << endl;
+        failed = true;
+    }
+    vector<double> all;
+    for (const vector<double>& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    if (all.empty()) return 1;
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all[min(all.size() - 1, size_t(p / 100 * all.size()))]; };
+    double megabytes = double(all.size()) * size / 1e6;
+    cout << all.size() << " requests of " << size << " bytes from " << clients << " clients in " << seconds << " s: "
+         << all.size() / seconds << " requests/s, " << megabytes / seconds << " MB/s" << endl;
+    cout << "latency us: p50 " << percentile(50) << ", p90 " << percentile(90) << ", p99 " << percentile(99)
+         << ", p99.9 " << percentile(99.9) << ", max " << all.back() << endl;
+    return failed ? 1 : 0;
+}
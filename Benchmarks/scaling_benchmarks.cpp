@@ -0,0 +1,261 @@
+// Empirical scaling: each compressor and decompressor swept over several decades of input size with
+// Complexity() fitting, so a quadratic path shows up as O(N^2) long before it hits production sizes
+// The parallel block paths are swept over 1..hardware_concurrency threads and report speedup and efficiency
+
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "LZ77/LZ77.h"
+#include "Huffman/Huffman.h"
+#include "Deflate/Deflate.h"
+#include "BenchData.h"
+
+using namespace std;
+
+static const int WINDOW_SIZE = 4096;
+
+//// COMPRESSORS
+static void BM_BruteForceCompress(benchmark::State& state) {
+    LZ77 lz;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lz.working_compress(input, WINDOW_SIZE).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_DequeCompress(benchmark::State& state) {
+    LZ77 lz;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lz.deque_compress(input, WINDOW_SIZE).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_RabinKarpCompress(benchmark::State& state) {
+    LZ77 lz;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lz.rabin_karp_compress(input, WINDOW_SIZE).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+// Level 1 and level 9 on text, and the ultra level on data that keeps every hash chain busy
+static void BM_HashChainCompress(benchmark::State& state, int level, bool repetitive) {
+    LZ77 lz;
+    vector<unsigned char> input = repetitive ? makeRepetitive(state.range(0)) : makeText(state.range(0));
+    CompressionParams params = CompressionParams::fromLevel(level);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lz.hash_chain_compress(input, params.windowSize, params.chainDepth, params.niceLength, params.parser == Parser::Lazy).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_HuffmanCodes(benchmark::State& state, bool useDeque) {
+    Huffman huff;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        unordered_map<unsigned char, string> codes = useDeque ? huff.deque_generateHuffmanCodes(input) : huff.generateHuffmanCodes(input);
+        benchmark::DoNotOptimize(codes);
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_HuffmanEncode(benchmark::State& state) {
+    Huffman huff;
+    vector<unsigned char> input = makeText(state.range(0));
+    unordered_map<unsigned char, string> codes = huff.generateHuffmanCodes(input);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(huff.encode(input, codes).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_DeflateCompress(benchmark::State& state) {
+    Deflate deflate;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(deflate.compress(input, CompressionParams::DEFAULT_LEVEL).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+//// DECOMPRESSORS
+static void BM_HuffmanDecode(benchmark::State& state, bool useTable) {
+    Huffman huff;
+    vector<unsigned char> input = makeText(state.range(0));
+    unordered_map<unsigned char, string> codes = huff.generateHuffmanCodes(input);
+    vector<unsigned char> encoded = huff.encode(input, codes);
+    TrieNode* trie = huff.buildTrie(codes);
+    HuffmanDecodeTable table = Huffman::buildDecodeTable(codes);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize((useTable ? huff.decode(encoded, table) : huff.decode(encoded, trie)).data());
+    }
+    Huffman::deleteTrie(trie);
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_DecompressToBytes(benchmark::State& state) {
+    LZ77 lz;
+    vector<unsigned char> input = makeText(state.range(0));
+    vector<LZ77Token> tokens = lz.byteStreamToTokens(lz.hash_chain_compress(input, WINDOW_SIZE, 32, 128, true));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lz.decompressToBytes(tokens).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_DeflateDecompress(benchmark::State& state) {
+    Deflate deflate;
+    vector<unsigned char> input = makeText(state.range(0));
+    vector<unsigned char> compressed = deflate.compress(input, CompressionParams::DEFAULT_LEVEL);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(deflate.decompress(compressed).data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    state.SetComplexityN(state.range(0));
+}
+
+// 4096 messages of range(0) bytes each, one compress() per message against one compressBatch, with and without a shared table
+static void BM_CompressMessages(benchmark::State& state, bool batch, unsigned char sharedTableId) {
+    Deflate deflate;
+    vector<unsigned char> text = makeText(4 << 20);
+    vector<vector<unsigned char>> messages;
+    vector<ByteSpan> spans;
+    for (size_t i = 0; i < 4096; ++i) {
+        size_t start = (i * 7919 * state.range(0)) % (text.size() - state.range(0));
+        messages.push_back(vector<unsigned char>(text.begin() + start, text.begin() + start + state.range(0)));
+    }
+    for (const vector<unsigned char>& message : messages) spans.push_back(ByteSpan{message.data(), message.size()});
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+    size_t compressedBytes = 0;
+    for (auto _ : state) {
+        compressedBytes = 0;
+        if (batch) {
+            Deflate::BatchResult result = deflate.compressBatch(spans, params, sharedTableId);
+            for (const vector<unsigned char>& output : result.outputs) compressedBytes += output.size();
+            // Frees the id for the next iteration, nothing reads these outputs
+            if (result.table) Huffman::unregisterTable(sharedTableId);
+        } else {
+            for (const vector<unsigned char>& message : messages) compressedBytes += deflate.compress(message, params).size();
+        }
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * messages.size() * state.range(0));
+    state.counters["ratio"] = double(messages.size() * state.range(0)) / compressedBytes;
+}
+
+//// THREAD SCALING
+// Wall time of the single threaded run for each size, the reference for speedup
+static map<pair<int, int64_t>, double> singleThreadSeconds;
+static mutex singleThreadMutex;
+
+static void reportScaling(benchmark::State& state, int path, double seconds) {
+    int threads = state.range(1);
+    double perIteration = seconds / max<int64_t>(state.iterations(), 1);
+    lock_guard<mutex> lock(singleThreadMutex);
+    pair<int, int64_t> key(path, state.range(0));
+    if (threads == 1) singleThreadSeconds[key] = perIteration;
+    auto reference = singleThreadSeconds.find(key);
+    if (reference != singleThreadSeconds.end()) {
+        double speedup = reference->second / perIteration;
+        state.counters["speedup"] = speedup;
+        state.counters["efficiency"] = speedup / threads;
+    }
+}
+
+static void BM_ParallelCompress(benchmark::State& state) {
+    Deflate deflate;
+    vector<unsigned char> input = makeText(state.range(0));
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+    params.blockSize = 256 << 10;
+    params.threads = state.range(1);
+    double seconds = 0;
+    for (auto _ : state) {
+        auto start = chrono::steady_clock::now();
+        benchmark::DoNotOptimize(deflate.compress(input, params).data());
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    reportScaling(state, 0, seconds);
+}
+
+static void BM_ParallelDecompress(benchmark::State& state) {
+    Deflate deflate;
+    vector<unsigned char> input = makeText(state.range(0));
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+    params.blockSize = 256 << 10;
+    params.threads = thread::hardware_concurrency();
+    vector<unsigned char> compressed = deflate.compress(input, params);
+    double seconds = 0;
+    for (auto _ : state) {
+        auto start = chrono::steady_clock::now();
+        benchmark::DoNotOptimize(deflate.decompress(compressed, state.range(1)).data());
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    reportScaling(state, 1, seconds);
+}
+
+// The whole input in one Huffman coded block, so the threads only have its sync points to split on
+static void BM_SyncIndexDecompress(benchmark::State& state) {
+    Deflate deflate;
+    vector<unsigned char> input = makeText(state.range(0));
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+    params.blockSize = input.size();
+    params.entropyCoder = EntropyCoder::Huffman;
+    params.syncInterval = 64 << 10;
+    vector<unsigned char> compressed = deflate.compress(input, params);
+    double seconds = 0;
+    for (auto _ : state) {
+        auto start = chrono::steady_clock::now();
+        benchmark::DoNotOptimize(deflate.decompress(compressed, state.range(1)).data());
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+    reportScaling(state, 2, seconds);
+}
+
+// Threads run 1..N in order, so the single threaded reference is always measured first
+static void threadSweep(benchmark::internal::Benchmark* b) {
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    for (int64_t size : {int64_t(4) << 20, int64_t(16) << 20}) {
+        for (int threads = 1; threads <= maxThreads; ++threads) b->Args({size, threads});
+    }
+}
+
+// The quadratic finders get 1KB-64KB, everything else 1KB-4MB
+BENCHMARK(BM_BruteForceCompress)->RangeMultiplier(4)->Range(1 << 10, 64 << 10)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_DequeCompress)->RangeMultiplier(4)->Range(1 << 10, 64 << 10)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_RabinKarpCompress)->RangeMultiplier(4)->Range(1 << 10, 64 << 10)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_HashChainCompress, level1, 1, false)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_HashChainCompress, level9, 9, false)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_HashChainCompress, ultra_repetitive, CompressionParams::ULTRA_LEVEL, true)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_HuffmanCodes, tree, false)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK_CAPTURE(BM_HuffmanCodes, deque, true)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK(BM_HuffmanEncode)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK(BM_DeflateCompress)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_HuffmanDecode, trie, false)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK_CAPTURE(BM_HuffmanDecode, table, true)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK(BM_DecompressToBytes)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK(BM_DeflateDecompress)->RangeMultiplier(4)->Range(1 << 10, 4 << 20)->Complexity();
+BENCHMARK_CAPTURE(BM_CompressMessages, loop, false, 0)->Arg(256)->Arg(1024)->Arg(4096)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_CompressMessages, batch, true, 0)->Arg(256)->Arg(1024)->Arg(4096)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_CompressMessages, batch_shared_table, true, 0x40)->Arg(256)->Arg(1024)->Arg(4096)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ParallelCompress)->Apply(threadSweep)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ParallelDecompress)->Apply(threadSweep)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SyncIndexDecompress)->Apply(threadSweep)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,350 @@
+// Microbenchmarks for each stage of the pipeline, run on in-memory buffers so no file I/O is timed
+// Every benchmark reports MB/s of the stage's own input through SetBytesProcessed
+
+#include <benchmark/benchmark.h>
+#include "LZ77/LZ77.h"
+#include "Huffman/Huffman.h"
+#include "FSE/FSE.h"
+#include "Kernels/Kernels.h"
+#include "Deflate/Deflate.h"
+#include "BenchData.h"
+
+using namespace std;
+
+static const int WINDOW_SIZE = 4096;
+
+// Builds every intermediate buffer once per input size, so each benchmark only times its own stage
+class StageFixture : public benchmark::Fixture {
+public:
+    vector<unsigned char> input;
+    vector<unsigned char> byteStream;
+    vector<LZ77Token> tokens;
+    LZ77Sequences sequences;
+    unordered_map<unsigned char, int> freq;
+    unordered_map<unsigned char, string> huffmanCodes;
+    vector<unsigned char> encoded;
+    TrieNode* trie = nullptr;
+    HuffmanDecodeTable decodeTable;
+    FSEEncodeTable fseEncodeTable;
+    FSEDecodeTable fseDecodeTable;
+    vector<unsigned char> fseEncoded;
+
+    void SetUp(const ::benchmark::State& state) override {
+        input = makeText(state.range(0));
+        LZ77 lz;
+        Huffman huff;
+        byteStream = lz.hash_chain_compress(input, WINDOW_SIZE, 32, 128, true);
+        tokens = lz.byteStreamToTokens(byteStream);
+        sequences.clear();
+        lz.byteStreamToSequences(byteStream.data(), byteStream.size(), sequences);
+        freq = huff.countBytes(byteStream);
+        huffmanCodes = huff.generateHuffmanCodes(freq);
+        encoded = huff.encode(byteStream, huffmanCodes);
+        trie = huff.buildTrie(huffmanCodes);
+        decodeTable = Huffman::buildDecodeTable(huffmanCodes);
+
+        uint32_t counts[256] = {0};
+        sequences.countBytes(counts);
+        int tableLog = FSE::optimalTableLog(byteStream.size(), static_cast<int>(freq.size()));
+        vector<uint16_t> normalized = FSE::normalizeCounts(counts, tableLog);
+        fseEncodeTable = FSE::buildEncodeTable(normalized, tableLog);
+        fseDecodeTable = FSE::buildDecodeTable(normalized, tableLog);
+        fseEncoded = FSE().encode(byteStream.data(), byteStream.size(), fseEncodeTable);
+    }
+
+    void TearDown(const ::benchmark::State&) override {
+        input.clear();
+        byteStream.clear();
+        tokens.clear();
+        sequences.clear();
+        encoded.clear();
+        fseEncoded.clear();
+        Huffman::deleteTrie(trie);
+        trie = nullptr;
+    }
+};
+
+//// HUFFMAN STAGES
+BENCHMARK_DEFINE_F(StageFixture, CountBytes)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        unordered_map<unsigned char, int> counts = huff.countBytes(byteStream);
+        benchmark::DoNotOptimize(counts);
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, BuildTree)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        priority_queue<Node*, vector<Node*>, Compare> nodes = huff.createNodes(freq);
+        Node* root = huff.buildTree(nodes);
+        benchmark::DoNotOptimize(root);
+        state.PauseTiming();
+        Huffman::deleteTree(root);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * freq.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DequeBuildTree)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        deque<Node*> nodes = huff.deque_createNodes(freq);
+        Node* root = huff.deque_buildTree(nodes);
+        benchmark::DoNotOptimize(root);
+        state.PauseTiming();
+        Huffman::deleteTree(root);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * freq.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, CountSequenceBytes)(benchmark::State& state) {
+    for (auto _ : state) {
+        uint32_t counts[256] = {0};
+        sequences.countBytes(counts);
+        benchmark::DoNotOptimize(counts);
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, Encode)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        vector<unsigned char> out = huff.encode(byteStream, huffmanCodes);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DecodeTrie)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        vector<unsigned char> out = huff.decode(encoded, trie);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DecodeTable)(benchmark::State& state) {
+    Huffman huff;
+    for (auto _ : state) {
+        vector<unsigned char> out = huff.decode(encoded, decodeTable);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, FseEncode)(benchmark::State& state) {
+    FSE fse;
+    for (auto _ : state) {
+        vector<unsigned char> out = fse.encode(byteStream.data(), byteStream.size(), fseEncodeTable);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+    state.counters["bytes"] = fseEncoded.size();
+    state.counters["huffman_bytes"] = encoded.size();
+}
+
+BENCHMARK_DEFINE_F(StageFixture, FseDecode)(benchmark::State& state) {
+    FSE fse;
+    for (auto _ : state) {
+        vector<unsigned char> out = fse.decode(fseEncoded.data(), fseEncoded.size(), byteStream.size(), fseDecodeTable);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+//// LZ77 STAGES
+BENCHMARK_DEFINE_F(StageFixture, BruteForceCompress)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.working_compress(input, WINDOW_SIZE);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DequeCompress)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.deque_compress(input, WINDOW_SIZE);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, RabinKarpCompress)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.rabin_karp_compress(input, WINDOW_SIZE);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+// LZ77::compress (suffix array) indexes bee-movie.txt from the working directory rather than its input,
+// so it can't be timed on an in-memory buffer and is left to BM_Deflate in main
+
+BENCHMARK_DEFINE_F(StageFixture, HashChainCompress)(benchmark::State& state) {
+    LZ77 lz;
+    CompressionParams params = CompressionParams::fromLevel(state.range(1));
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.hash_chain_compress(input, params.windowSize, params.chainDepth, params.niceLength, params.parser == Parser::Lazy);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+// Level 6 parse with each minimum match and hash width, window 0 is an odd size that takes the runtime window version
+BENCHMARK_DEFINE_F(StageFixture, HashChainParse)(benchmark::State& state) {
+    LZ77 lz;
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+    int window = state.range(3) ? params.windowSize : params.windowSize - 1;
+    LZ77Sequences parsed;
+    for (auto _ : state) {
+        parsed.clear();
+        lz.hash_chain_parse(input.data(), input.size(), window, params.chainDepth, params.niceLength, true, parsed, state.range(1), state.range(2));
+        benchmark::DoNotOptimize(parsed.literals.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, TokensToByteStream)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.tokensToByteStream(tokens);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, ByteStreamToTokens)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<LZ77Token> out = lz.byteStreamToTokens(byteStream);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, SequencesToByteStream)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.sequencesToByteStream(sequences);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, ByteStreamToSequences)(benchmark::State& state) {
+    LZ77 lz;
+    LZ77Sequences out;
+    for (auto _ : state) {
+        lz.byteStreamToSequences(byteStream.data(), byteStream.size(), out);
+        benchmark::DoNotOptimize(out.literals.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * byteStream.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DecompressToBytes)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.decompressToBytes(tokens);
+        benchmark::DoNotOptimize(out.data());
+    }
+    // Reported against the decompressed size, like any decompressor
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+BENCHMARK_DEFINE_F(StageFixture, DecompressSequences)(benchmark::State& state) {
+    LZ77 lz;
+    for (auto _ : state) {
+        vector<unsigned char> out = lz.decompressToBytes(sequences);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+//// KERNELS
+// Every ISA level this CPU runs, on the same buffers
+static const KernelTable* kernelOrSkip(benchmark::State& state, KernelIsa isa) {
+    const KernelTable* table = Kernels::forIsa(isa);
+    if (!table) state.SkipWithError("ISA not supported on this CPU");
+    return table;
+}
+
+static void BM_KernelMatchLength(benchmark::State& state, KernelIsa isa) {
+    const KernelTable* table = kernelOrSkip(state, isa);
+    if (!table) return;
+    // Identical buffers, so every call runs to the limit
+    vector<unsigned char> a = makeText(state.range(0));
+    vector<unsigned char> b = a;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(table->matchLength(a.data(), b.data(), a.size()));
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * a.size());
+}
+
+static void BM_KernelHistogram(benchmark::State& state, KernelIsa isa) {
+    const KernelTable* table = kernelOrSkip(state, isa);
+    if (!table) return;
+    vector<unsigned char> input = makeText(state.range(0));
+    for (auto _ : state) {
+        uint32_t counts[256] = {0};
+        table->histogram(input.data(), input.size(), counts);
+        benchmark::DoNotOptimize(counts);
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * input.size());
+}
+
+static void BM_KernelCopyMatch(benchmark::State& state, KernelIsa isa) {
+    const KernelTable* table = kernelOrSkip(state, isa);
+    if (!table) return;
+    // 258 byte matches (the longest DEFLATE allows) from 1KB back
+    const size_t OFFSET = 1024, LENGTH = 258;
+    vector<unsigned char> buffer = makeText(state.range(0) + OFFSET + LENGTH + Kernels::COPY_SLACK);
+    for (auto _ : state) {
+        for (size_t pos = OFFSET; pos + LENGTH <= OFFSET + state.range(0); pos += LENGTH) {
+            table->copyMatch(buffer.data() + pos, OFFSET, LENGTH);
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * state.range(0));
+}
+
+#define KERNEL_BENCHMARKS(kernel) \
+    BENCHMARK_CAPTURE(kernel, scalar, KernelIsa::Scalar)->Arg(1 << 20); \
+    BENCHMARK_CAPTURE(kernel, sse2, KernelIsa::SSE2)->Arg(1 << 20); \
+    BENCHMARK_CAPTURE(kernel, avx2, KernelIsa::AVX2)->Arg(1 << 20); \
+    BENCHMARK_CAPTURE(kernel, avx512, KernelIsa::AVX512)->Arg(1 << 20)
+
+KERNEL_BENCHMARKS(BM_KernelMatchLength);
+// Every table has the same histogram, one run is enough
+BENCHMARK_CAPTURE(BM_KernelHistogram, scalar, KernelIsa::Scalar)->Arg(1 << 20);
+KERNEL_BENCHMARKS(BM_KernelCopyMatch);
+
+// 4KB to 1MB, the quadratic LZ77 finders only get the small sizes
+BENCHMARK_REGISTER_F(StageFixture, CountBytes)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, BuildTree)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, DequeBuildTree)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, CountSequenceBytes)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, Encode)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, DecodeTrie)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, DecodeTable)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, FseEncode)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, FseDecode)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, BruteForceCompress)->RangeMultiplier(4)->Range(4 << 10, 64 << 10)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(StageFixture, DequeCompress)->RangeMultiplier(4)->Range(4 << 10, 64 << 10)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(StageFixture, RabinKarpCompress)->RangeMultiplier(4)->Range(4 << 10, 64 << 10)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(StageFixture, HashChainCompress)->ArgsProduct({{64 << 10, 1 << 20}, {1, 6, 9}})->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(StageFixture, HashChainParse)->ArgsProduct({{1 << 20}, {3, 4, 6}, {12, 15, 16}, {0, 1}})->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(StageFixture, TokensToByteStream)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, ByteStreamToTokens)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, SequencesToByteStream)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, ByteStreamToSequences)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, DecompressToBytes)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+BENCHMARK_REGISTER_F(StageFixture, DecompressSequences)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+
+BENCHMARK_MAIN();
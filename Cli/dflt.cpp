@@ -0,0 +1,329 @@
+// Command line compressor for shell pipelines, in the style of gzip/pigz
+//
+// dflt [compress|decompress|test|list] [options] [file...]
+//   -d, --decompress     decompress, same as the decompress command
+//   -t, --test           check that each input decodes, same as the test command
+//       --list           print the sizes of each compressed input, same as the list command
+//   -c, --stdout         write to stdout and keep the inputs
+//   -k, --keep           keep the inputs (by default they are removed once the output is written, as gzip does)
+//   -f, --force          overwrite existing outputs
+//   -v, --verbose        print each input's ratio to stderr
+//   -p, --threads N      compression and file decompression threads, default all of them
+//   -l, --level N        1-9, 10 for ultra, default 6. -1 ... -9 work too
+//       --block-size N   compression block size, K, M and G suffixes
+//       --memory-limit N working memory budget, see Deflate::fitMemoryLimit
+// With no files, or "-", stdin goes to stdout. File outputs get or lose the .dflt suffix
+// Concatenated outputs, such as dflt -c a b, decompress to the concatenation of their inputs, as with gzip
+// Exit status 0 on success, 1 on an error in any input, 2 on a usage error
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mio/mio.hpp>
+#include "Deflate/Deflate.h"
+
+using namespace std;
+
+static const string SUFFIX = ".dflt";
+
+enum class Command {
+    Compress,
+    Decompress,
+    Test,
+    List
+};
+
+struct Options {
+    Command command = Command::Compress;
+    bool toStdout = false;
+    bool keep = false;
+    bool force = false;
+    bool verbose = false;
+    CompressionParams params = CompressionParams::fromLevel(CompressionParams::DEFAULT_LEVEL);
+};
+
+// Output to a file descriptor through a large buffer. Seeks only when the descriptor can honour them, so
+// compressStream patches the size into regular files but not into pipes or files opened for appending
+class FdOutput : public streambuf {
+public:
+    explicit FdOutput(int fd) : fd(fd), buffer(1 << 20) {
+        int flags = fcntl(fd, F_GETFL);
+        seekable = flags != -1 && !(flags & O_APPEND) && lseek(fd, 0, SEEK_CUR) != -1;
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    ~FdOutput() { sync(); }
+
+protected:
+    int overflow(int c) override {
+        if (!flush()) return traits_type::eof();
+        if (c != traits_type::eof()) sputc(static_cast<char>(c));
+        return traits_type::not_eof(c);
+    }
+    int sync() override { return flush() ? 0 : -1; }
+    pos_type seekoff(off_type offset, ios_base::seekdir direction, ios_base::openmode) override {
+        if (!seekable || !flush()) return pos_type(off_type(-1));
+        off_t result = lseek(fd, offset, direction == ios_base::beg ? SEEK_SET : direction == ios_base::cur ? SEEK_CUR : SEEK_END);
+        return pos_type(off_type(result));
+    }
+    pos_type seekpos(pos_type position, ios_base::openmode mode) override { return seekoff(off_type(position), ios_base::beg, mode); }
+
+private:
+    bool flush() {
+        const char* data = pbase();
+        size_t size = pptr() - pbase();
+        while (size) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            data += n;
+            size -= n;
+        }
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return true;
+    }
+
+    int fd;
+    vector<char> buffer;
+    bool seekable;
+};
+
+static size_t parseSize(const string& text) {
+    // stoull takes "-1" as 2^64 - 1
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) throw std::invalid_argument("Bad size " + text);
+    size_t end;
+    unsigned long long value = stoull(text, &end);
+    string unit = text.substr(end);
+    int shift = 0;
+    if (unit.size() > 1) throw std::invalid_argument("Bad size " + text);
+    if (!unit.empty()) {
+        switch (unit[0]) {
+            case 'K': case 'k': shift = 10; break;
+            case 'M': case 'm': shift = 20; break;
+            case 'G': case 'g': shift = 30; break;
+            default: throw std::invalid_argument("Bad size " + text);
+        }
+    }
+    if (value > (SIZE_MAX >> shift)) throw std::out_of_range("Size too large " + text);
+    return static_cast<size_t>(value) << shift;
+}
+
+// Level presets replace every search parameter, the ones set on their own are kept
+static void setLevel(Options& options, int level) {
+    if (level < CompressionParams::MIN_LEVEL || level > CompressionParams::ULTRA_LEVEL) throw std::invalid_argument("Bad level " + to_string(level));
+    CompressionParams params = CompressionParams::fromLevel(level);
+    params.threads = options.params.threads;
+    params.blockSize = options.params.blockSize;
+    params.memoryLimit = options.params.memoryLimit;
+    options.params = params;
+}
+
+static bool exists(const string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+static bool endsWith(const string& text, const string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void report(const Options& options, const string& name, uint64_t raw, uint64_t compressed) {
+    if (!options.verbose) return;
+    double saved = raw ? 100.0 * (1.0 - double(compressed) / raw) : 0.0;
+    fprintf(stderr, "%s: %llu -> %llu bytes, %.1f%% saved\n", name.c_str(), (unsigned long long)raw, (unsigned long long)compressed, saved);
+}
+
+// The whole of a file, mapped, or of stdin, read. mio can't map an empty file, so that is left empty
+struct Input {
+    mio::mmap_source mapped;
+    string read;
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+};
+
+static void loadInput(const string& path, Input& input) {
+    if (path == "-") {
+        ostringstream all;
+        all << cin.rdbuf();
+        input.read = all.str();
+        input.data = reinterpret_cast<const unsigned char*>(input.read.data());
+        input.size = input.read.size();
+        return;
+    }
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) throw std::runtime_error(strerror(errno));
+    if (info.st_size == 0) return;
+    error_code error;
+    input.mapped.map(path, error);
+    if (error) throw std::runtime_error(error.message());
+    input.data = reinterpret_cast<const unsigned char*>(input.mapped.data());
+    input.size = input.mapped.size();
+}
+
+static void compressFile(Deflate& deflate, const Options& options, const string& path) {
+    if (path != "-" && !options.toStdout && endsWith(path, SUFFIX)) throw std::runtime_error("already has the " + SUFFIX + " suffix");
+    ifstream file;
+    if (path != "-") {
+        file.open(path, ios::binary);
+        if (!file) throw std::runtime_error(strerror(errno));
+    }
+    istream& in = path == "-" ? cin : file;
+
+    if (path == "-" || options.toStdout) {
+        FdOutput buffer(STDOUT_FILENO);
+        ostream out(&buffer);
+        deflate.compressStream(in, out, options.params);
+        if (!out.flush() || in.bad()) throw std::runtime_error("write failed");
+        return;
+    }
+    string outputPath = path + SUFFIX;
+    if (!options.force && exists(outputPath)) throw std::runtime_error(outputPath + " already exists, -f overwrites it");
+    {
+        ofstream out(outputPath, ios::binary | ios::trunc);
+        if (!out) throw std::runtime_error(outputPath + ": " + strerror(errno));
+        deflate.compressStream(in, out, options.params);
+        if (!out.flush() || in.bad()) {
+            remove(outputPath.c_str());
+            throw std::runtime_error(outputPath + ": write failed");
+        }
+        struct stat info;
+        if (options.verbose && stat(path.c_str(), &info) == 0) report(options, path, static_cast<uint64_t>(info.st_size), static_cast<uint64_t>(out.tellp()));
+    }
+    if (!options.keep) remove(path.c_str());
+}
+
+static void decompressFile(Deflate& deflate, const Options& options, const string& path) {
+    if (path == "-" || options.toStdout) {
+        // Streamed, so pipes decode in constant memory. One thread, the stream decoder goes block by block
+        ifstream file;
+        if (path != "-") {
+            file.open(path, ios::binary);
+            if (!file) throw std::runtime_error(strerror(errno));
+        }
+        FdOutput buffer(STDOUT_FILENO);
+        ostream out(&buffer);
+        deflate.decompressStream(path == "-" ? cin : file, out);
+        if (!out.flush()) throw std::runtime_error("write failed");
+        return;
+    }
+    if (!endsWith(path, SUFFIX)) throw std::runtime_error("doesn't have the " + SUFFIX + " suffix");
+    string outputPath = path.substr(0, path.size() - SUFFIX.size());
+    if (!options.force && exists(outputPath)) throw std::runtime_error(outputPath + " already exists, -f overwrites it");
+    Input input;
+    loadInput(path, input);
+    // File to file decodes blocks on every thread straight into the mapped output
+    try {
+        deflate.decompressToFile(input.data, input.size, outputPath, options.params.threads);
+    } catch (...) {
+        remove(outputPath.c_str());
+        throw;
+    }
+    report(options, path, Deflate::decompressedSize(input.data, input.size), input.size);
+    if (!options.keep) remove(path.c_str());
+}
+
+static void testFile(Deflate& deflate, const Options& options, const string& path) {
+    ifstream file;
+    if (path != "-") {
+        file.open(path, ios::binary);
+        if (!file) throw std::runtime_error(strerror(errno));
+    }
+    // The format has no checksum, so this checks that every block decodes and the sizes add up
+    uint64_t total = 0;
+    deflate.decompressStream(path == "-" ? cin : file, [&](const unsigned char*, size_t size) { total += size; });
+    if (options.verbose) fprintf(stderr, "%s: OK, %llu bytes\n", path.c_str(), (unsigned long long)total);
+}
+
+static void listFile(const string& path, bool header) {
+    Input input;
+    loadInput(path, input);
+    uint64_t raw = Deflate::decompressedSize(input.data, input.size);
+    if (header) printf("%20s %20s %7s  %s\n", "compressed", "uncompressed", "saved", "uncompressed_name");
+    string name = path == "-" ? "stdout" : endsWith(path, SUFFIX) ? path.substr(0, path.size() - SUFFIX.size()) : path;
+    double saved = raw ? 100.0 * (1.0 - double(input.size) / raw) : 0.0;
+    printf("%20llu %20llu %6.1f%%  %s\n", (unsigned long long)input.size, (unsigned long long)raw, saved, name.c_str());
+}
+
+static int usage() {
+    cerr << "usage: dflt [compress|decompress|test|list] [-d|-t|--list] [-c] [-k] [-f] [-v] [-p threads] [-l level]\n"
+            "            [--block-size size] [--memory-limit size] [file...]" << endl;
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    ios::sync_with_stdio(false);
+    Options options;
+    options.params.threads = max(1u, thread::hardware_concurrency());
+    vector<string> files;
+    try {
+        int first = 1;
+        if (argc > 1) {
+            string command = argv[1];
+            if (command == "compress") { options.command = Command::Compress; ++first; }
+            else if (command == "decompress") { options.command = Command::Decompress; ++first; }
+            else if (command == "test") { options.command = Command::Test; ++first; }
+            else if (command == "list") { options.command = Command::List; ++first; }
+        }
+        bool optionsDone = false;
+        for (int i = first; i < argc; ++i) {
+            string arg = argv[i];
+            string value = i + 1 < argc ? argv[i + 1] : "";
+            if (optionsDone || arg == "-" || arg[0] != '-') { files.push_back(arg); continue; }
+            if (arg == "--") optionsDone = true;
+            else if (arg == "-d" || arg == "--decompress") options.command = Command::Decompress;
+            else if (arg == "-t" || arg == "--test") options.command = Command::Test;
+            else if (arg == "--list") options.command = Command::List;
+            else if (arg == "-c" || arg == "--stdout") options.toStdout = true;
+            else if (arg == "-k" || arg == "--keep") options.keep = true;
+            else if (arg == "-f" || arg == "--force") options.force = true;
+            else if (arg == "-v" || arg == "--verbose") options.verbose = true;
+            else if ((arg == "-p" || arg == "--threads") && i + 1 < argc) { options.params.threads = max(1, stoi(value)); ++i; }
+            else if ((arg == "-l" || arg == "--level") && i + 1 < argc) { setLevel(options, stoi(value)); ++i; }
+            else if (arg.size() == 2 && arg[1] >= '1' && arg[1] <= '9') setLevel(options, arg[1] - '0');
+            else if (arg == "--block-size" && i + 1 < argc) {
+                options.params.blockSize = parseSize(value);
+                if (options.params.blockSize < Deflate::MIN_BLOCK_SIZE) throw std::invalid_argument("Block size below " + to_string(Deflate::MIN_BLOCK_SIZE));
+                if (options.params.blockSize > Deflate::MAX_BLOCK_SIZE) throw std::invalid_argument("Block size above " + to_string(Deflate::MAX_BLOCK_SIZE));
+                ++i;
+            }
+            else if (arg == "--memory-limit" && i + 1 < argc) { options.params.memoryLimit = parseSize(value); ++i; }
+            else return usage();
+        }
+    } catch (const std::exception& e) {
+        cerr << "dflt: " << e.what() << endl;
+        return usage();
+    }
+    if (files.empty()) files.push_back("-");
+    // Compressed data on a terminal is never wanted, gzip refuses it too
+    bool writesStdout = options.command == Command::Compress && (options.toStdout || find(files.begin(), files.end(), "-") != files.end());
+    if (writesStdout && isatty(STDOUT_FILENO) && !options.force) {
+        cerr << "dflt: compressed data not written to a terminal, -f forces it" << endl;
+        return 1;
+    }
+
+    Deflate deflate;
+    int status = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        try {
+            switch (options.command) {
+                case Command::Compress: compressFile(deflate, options, files[i]); break;
+                case Command::Decompress: decompressFile(deflate, options, files[i]); break;
+                case Command::Test: testFile(deflate, options, files[i]); break;
+                case Command::List: listFile(files[i], i == 0); break;
+            }
+        } catch (const std::exception& e) {
+            cerr << "dflt: " << (files[i] == "-" ? "stdin" : files[i]) << ": " << e.what() << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,104 @@
+#include "Dedup.h"
+#include "Trace/Trace.h"
+#include <xxhash.h>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+
+const size_t Dedup::MIN_AVERAGE_SIZE;
+
+// Gear table, one random 64 bit value per byte, from splitmix64 so every build chunks the same way
+struct GearTable {
+    uint64_t values[256];
+    GearTable() {
+        uint64_t state = 0x5EED0DEDu;
+        for (int i = 0; i < 256; ++i) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable GEAR;
+
+vector<size_t> Dedup::chunk(const unsigned char* data, size_t size, size_t averageSize) {
+    TRACE_SCOPE("dedup_chunk");
+    if (averageSize < MIN_AVERAGE_SIZE) throw std::runtime_error("Dedup chunks must average at least 256 bytes");
+    int bits = 63 - __builtin_clzll(averageSize);
+    const size_t average = size_t(1) << bits, minSize = average / 4, maxSize = average * 8;
+    // The hash shifts left, so its top bits cover the most bytes. Two more bits before the average size and two
+    // fewer after it pull the chunk sizes towards the average (normalized chunking)
+    const uint64_t maskS = ~uint64_t(0) << (64 - (bits + 2));
+    const uint64_t maskL = ~uint64_t(0) << (64 - (bits - 2));
+
+    vector<size_t> ends;
+    size_t start = 0;
+    while (start < size) {
+        size_t remaining = size - start;
+        if (remaining <= minSize) {
+            ends.push_back(size);
+            break;
+        }
+        // Nothing before minSize can be a boundary, so it isn't hashed
+        size_t normal = start + min(remaining, average), end = start + min(remaining, maxSize);
+        size_t i = start + minSize;
+        uint64_t hash = 0;
+        for (; i < normal; ++i) {
+            hash = (hash << 1) + GEAR.values[data[i]];
+            if (!(hash & maskS)) break;
+        }
+        if (i == normal) {
+            for (; i < end; ++i) {
+                hash = (hash << 1) + GEAR.values[data[i]];
+                if (!(hash & maskL)) break;
+            }
+        }
+        size_t cut = min(i + 1, end);
+        ends.push_back(cut);
+        start = cut;
+    }
+    return ends;
+}
+
+struct Fingerprint {
+    uint64_t low, high;
+    bool operator==(const Fingerprint& other) const { return low == other.low && high == other.high; }
+};
+
+struct FingerprintHash {
+    size_t operator()(const Fingerprint& fingerprint) const { return static_cast<size_t>(fingerprint.low); }
+};
+
+vector<DedupSegment> Dedup::segments(const unsigned char* data, size_t size, size_t averageSize) {
+    vector<size_t> ends = chunk(data, size, averageSize);
+    TRACE_SCOPE("dedup_fingerprint");
+    // Offset of the first chunk with each fingerprint
+    unordered_map<Fingerprint, uint64_t, FingerprintHash> seen;
+    seen.reserve(ends.size());
+    vector<DedupSegment> result;
+    size_t start = 0;
+    for (size_t end : ends) {
+        size_t length = end - start;
+        XXH128_hash_t hash = XXH3_128bits(data + start, length);
+        Fingerprint fingerprint = {hash.low64, hash.high64};
+        auto found = seen.insert(make_pair(fingerprint, uint64_t(start)));
+        // Equal fingerprints are checked byte for byte, a collision only costs a missed duplicate
+        uint64_t source = found.first->second;
+        bool duplicate = !found.second && source + length <= start && memcmp(data + source, data + start, length) == 0;
+
+        DedupSegment* last = result.empty() ? nullptr : &result.back();
+        if (duplicate && last && last->reference && last->source + last->size == source) {
+            last->size += length;
+        } else if (!duplicate && last && !last->reference) {
+            last->size += length;
+        } else {
+            DedupSegment segment = {start, length, duplicate, duplicate ? source : 0};
+            result.push_back(segment);
+        }
+        start = end;
+    }
+    return result;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Long range deduplication ahead of LZ77. The input is cut into content defined chunks (FastCDC: a Gear rolling
+// hash with normalized chunking), so an inserted or removed byte only moves the boundaries around it, and each
+// chunk is fingerprinted with XXH3-128. A chunk seen before, at any distance, becomes a reference to its first copy.
+
+// A run of the input, either bytes to compress or a copy of size bytes from source, earlier in the input
+struct DedupSegment {
+    uint64_t offset;
+    uint64_t size;
+    bool reference;
+    uint64_t source;
+};
+
+class Dedup {
+public:
+    static const size_t MIN_AVERAGE_SIZE = 256;
+
+    // End offsets of the chunks of data, between averageSize / 4 and averageSize * 8 bytes except the last one
+    // averageSize is rounded down to a power of two
+    static vector<size_t> chunk(const unsigned char* data, size_t size, size_t averageSize);
+
+    // data as runs of first seen chunks and references to an earlier copy, in order and covering all of it
+    // Neighbouring unique chunks are merged, as are references that continue the previous one
+    static vector<DedupSegment> segments(const unsigned char* data, size_t size, size_t averageSize);
+};
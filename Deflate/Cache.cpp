@@ -0,0 +1,129 @@
+#include "Cache.h"
+#include "Trace/Trace.h"
+#include <xxhash.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void putValue(vector<unsigned char>& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+CacheKey CacheKey::of(const unsigned char* data, size_t size, const CompressionParams& params) {
+    TRACE_SCOPE("cache_key");
+    XXH128_hash_t hash = XXH3_128bits(data, size);
+    // Threads don't change the output, the memory limit only through what fitMemoryLimit makes of it
+    CompressionParams fitted = Deflate::fitMemoryLimit(params);
+    vector<unsigned char> fields;
+    putValue(fields, Deflate::FORMAT_VERSION);
+    putValue(fields, static_cast<uint64_t>(fitted.matchFinder));
+    putValue(fields, fitted.windowSize);
+    putValue(fields, fitted.chainDepth);
+    putValue(fields, fitted.niceLength);
+    putValue(fields, fitted.minMatch);
+    putValue(fields, fitted.hashBits);
+    putValue(fields, fitted.skipTrigger);
+    putValue(fields, static_cast<uint64_t>(fitted.parser));
+    putValue(fields, static_cast<uint64_t>(fitted.entropyCoder));
+    putValue(fields, fitted.blockSize);
+    putValue(fields, fitted.syncInterval);
+    putValue(fields, fitted.dedupChunkSize);
+    // Blocks may code with any selectable registered table, so those tables are part of the key
+    for (int id = Huffman::FIXED_TABLE_ID + 1; id < Huffman::RESERVED_TABLE_ID; ++id) {
+        shared_ptr<const StaticHuffmanTable> table = Huffman::findTable(static_cast<unsigned char>(id));
+        if (!table || !table->selectable) continue;
+        fields.push_back(static_cast<unsigned char>(id));
+        for (int byte = 0; byte < 256; ++byte) {
+            auto code = table->codes.find(static_cast<unsigned char>(byte));
+            fields.push_back(code == table->codes.end() ? 0 : static_cast<unsigned char>(code->second.size()));
+        }
+    }
+    CacheKey key = {hash.low64, hash.high64, XXH3_64bits(fields.data(), fields.size())};
+    return key;
+}
+
+string CacheKey::hex() const {
+    ostringstream out;
+    out << std::hex << setfill('0') << setw(16) << high << setw(16) << low << setw(16) << params;
+    return out.str();
+}
+
+bool CompressionCache::lookup(const CacheKey& key, vector<unsigned char>& output) {
+    TRACE_SCOPE("cache_lookup");
+    bool hit = load(key, output);
+    ++(hit ? hitCount : missCount);
+    return hit;
+}
+
+double CompressionCache::hitRate() const {
+    uint64_t total = hits() + misses();
+    return total ? double(hits()) / total : 0;
+}
+
+MemoryCache::MemoryCache(size_t capacity) : capacity(capacity) {}
+
+size_t MemoryCache::bytes() const {
+    lock_guard<mutex> guard(lock);
+    return used;
+}
+
+bool MemoryCache::load(const CacheKey& key, vector<unsigned char>& output) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) return false;
+    entries.splice(entries.begin(), entries, it->second);
+    output = it->second->second;
+    return true;
+}
+
+void MemoryCache::save(const CacheKey& key, const vector<unsigned char>& output) {
+    if (output.size() > capacity) return;
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        used -= it->second->second.size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    while (!entries.empty() && used + output.size() > capacity) {
+        used -= entries.back().second.size();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.emplace_front(key, output);
+    index[key] = entries.begin();
+    used += output.size();
+}
+
+DirectoryCache::DirectoryCache(const string& path) : path(path) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) throw std::runtime_error("Cannot create cache directory " + path);
+}
+
+bool DirectoryCache::load(const CacheKey& key, vector<unsigned char>& output) {
+    ifstream in(path + "/" + key.hex(), ios::binary);
+    if (!in) return false;
+    output.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+void DirectoryCache::save(const CacheKey& key, const vector<unsigned char>& output) {
+    string name = path + "/" + key.hex();
+    ostringstream temporary;
+    temporary << name << ".tmp." << getpid() << "." << this_thread::get_id();
+    {
+        ofstream out(temporary.str(), ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char*>(output.data()), output.size());
+        if (!out) {
+            remove(temporary.str().c_str());
+            return;
+        }
+    }
+    // A cache that can't be written to only costs the next lookup a miss
+    if (rename(temporary.str().c_str(), name.c_str()) != 0) remove(temporary.str().c_str());
+}
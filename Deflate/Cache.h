@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "Deflate.h"
+
+using namespace std;
+
+// What a compressed result is cached under: XXH3-128 of the input and a hash of every parameter that changes the
+// output, after fitMemoryLimit, plus the format version
+struct CacheKey {
+    uint64_t low;
+    uint64_t high;
+    uint64_t params;
+
+    static CacheKey of(const unsigned char* data, size_t size, const CompressionParams& params);
+    bool operator==(const CacheKey& other) const { return low == other.low && high == other.high && params == other.params; }
+    string hex() const;
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey& key) const { return static_cast<size_t>(key.low ^ key.params); }
+};
+
+// Compressed outputs by CacheKey, for Deflate::setCache. Byte identical inputs compressed with the same parameters
+// then skip LZ77 and entropy coding. Implementations have to be safe to call from several threads
+class CompressionCache {
+public:
+    virtual ~CompressionCache() {}
+
+    // True, with the cached output, when key is cached. Counts a hit or a miss
+    bool lookup(const CacheKey& key, vector<unsigned char>& output);
+    void store(const CacheKey& key, const vector<unsigned char>& output) { save(key, output); }
+
+    uint64_t hits() const { return hitCount.load(); }
+    uint64_t misses() const { return missCount.load(); }
+    double hitRate() const;
+
+protected:
+    virtual bool load(const CacheKey& key, vector<unsigned char>& output) = 0;
+    virtual void save(const CacheKey& key, const vector<unsigned char>& output) = 0;
+
+private:
+    atomic<uint64_t> hitCount{0};
+    atomic<uint64_t> missCount{0};
+};
+
+// In-process cache holding at most capacity bytes of outputs, least recently used ones are evicted first
+class MemoryCache : public CompressionCache {
+public:
+    explicit MemoryCache(size_t capacity);
+    size_t bytes() const;
+
+protected:
+    bool load(const CacheKey& key, vector<unsigned char>& output) override;
+    void save(const CacheKey& key, const vector<unsigned char>& output) override;
+
+private:
+    typedef list<pair<CacheKey, vector<unsigned char>>> Entries;
+    size_t capacity;
+    size_t used = 0;
+    Entries entries; // Most recently used first
+    unordered_map<CacheKey, Entries::iterator, CacheKeyHash> index;
+    mutable mutex lock;
+};
+
+// One file per output in a directory, named by the key, so the cache outlives the process and is shared by
+// every process pointed at it. Files are written under a temporary name and renamed, readers never see half of one
+class DirectoryCache : public CompressionCache {
+public:
+    // Creates the directory if it doesn't exist
+    explicit DirectoryCache(const string& path);
+
+protected:
+    bool load(const CacheKey& key, vector<unsigned char>& output) override;
+    void save(const CacheKey& key, const vector<unsigned char>& output) override;
+
+private:
+    string path;
+};
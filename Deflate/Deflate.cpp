@@ -0,0 +1,1646 @@
+#include "Deflate.h"
+#include "Cache.h"
+#include "Trace/Trace.h"
+#include "Kernels/Kernels.h"
+#include "Dedup/Dedup.h"
+#include "Delta/Delta.h"
+#include <xxhash.h>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <unistd.h>
+#include <mio/mio.hpp>
+
+static const unsigned char MAGIC[4] = {'D', 'F', 'L', 'T'};
+
+const int CompressionParams::MIN_LEVEL;
+const int CompressionParams::DEFAULT_LEVEL;
+const int CompressionParams::MAX_LEVEL;
+const int CompressionParams::ULTRA_LEVEL;
+const uint8_t Deflate::FORMAT_VERSION;
+const uint64_t Deflate::UNKNOWN_SIZE;
+const size_t Deflate::MIN_BLOCK_SIZE;
+const size_t Deflate::MAX_BLOCK_SIZE;
+const int Deflate::MAX_WINDOW_SIZE;
+const unsigned char Deflate::REPEAT_OFFSETS_FLAG;
+const unsigned char Deflate::SYNC_INDEX_FLAG;
+const unsigned char Deflate::STORED_FLAG;
+const unsigned char Deflate::REFERENCE_FLAG;
+const unsigned char Deflate::DELTA_FLAG;
+const unsigned char Deflate::DICTIONARY_FLAG;
+const unsigned char Deflate::FSE_TABLE_ID;
+const size_t Deflate::STREAM_CHUNK_SIZE;
+
+static void putU16(vector<unsigned char>& out, uint16_t value) {
+    out.push_back(static_cast<unsigned char>(value & 0xFF));
+    out.push_back(static_cast<unsigned char>((value >> 8) & 0xFF));
+}
+
+static void putU32(vector<unsigned char>& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<unsigned char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+static uint16_t getU16(const unsigned char* in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+static uint32_t getU32(const unsigned char* in) {
+    return uint32_t(in[0]) | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16) | (uint32_t(in[3]) << 24);
+}
+
+static void putU64(vector<unsigned char>& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<unsigned char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+static uint64_t getU64(const unsigned char* in) {
+    return uint64_t(getU32(in)) | (uint64_t(getU32(in + 4)) << 32);
+}
+
+static void writeStreamHeader(vector<unsigned char>& out, uint64_t rawSize) {
+    out.insert(out.end(), MAGIC, MAGIC + 4);
+    out.push_back(Deflate::FORMAT_VERSION);
+    putU64(out, rawSize);
+}
+
+// Where each block of a stream starts and how much it decodes to, from walking the block headers. Streams written one
+// after another decode to their concatenation, like decompressStream, so each block keeps its stream's version and start
+struct StreamBlocks {
+    vector<uint8_t> versions;
+    vector<size_t> payloadStart, payloadSizes, rawSizes, outputStart, streamStart;
+    uint64_t total = 0;
+};
+
+static StreamBlocks readStreamBlocks(const unsigned char* compressed, size_t size) {
+    StreamBlocks blocks;
+    size_t pos = 0;
+    do {
+        if (size - pos < 5 || !equal(MAGIC, MAGIC + 4, compressed + pos)) {
+            throw std::runtime_error("Not a Deflate stream");
+        }
+        uint8_t version = compressed[pos + 4];
+        if (version < 1 || version > Deflate::FORMAT_VERSION) {
+            throw std::runtime_error("Unsupported Deflate format version");
+        }
+        pos += 5;
+        uint64_t headerSize = Deflate::UNKNOWN_SIZE;
+        if (version >= 3) {
+            if (size - pos < 8) throw std::runtime_error("Truncated stream header");
+            headerSize = getU64(compressed + pos);
+            pos += 8;
+        }
+        uint64_t start = blocks.total;
+        // A raw size never reaches the magic read as a uint32, so a block header that starts with it is the next stream
+        while (pos < size && !(size - pos >= 4 && equal(MAGIC, MAGIC + 4, compressed + pos))) {
+            if (size - pos < 8) throw std::runtime_error("Truncated block header");
+            uint32_t rawSize = getU32(&compressed[pos]);
+            uint32_t payloadSize = getU32(&compressed[pos + 4]);
+            pos += 8;
+            if (rawSize > Deflate::MAX_BLOCK_SIZE) throw std::runtime_error("Block larger than Deflate::MAX_BLOCK_SIZE");
+            if (size - pos < payloadSize) throw std::runtime_error("Truncated block");
+            blocks.versions.push_back(version);
+            blocks.payloadStart.push_back(pos);
+            blocks.payloadSizes.push_back(payloadSize);
+            blocks.rawSizes.push_back(rawSize);
+            blocks.outputStart.push_back(blocks.total);
+            blocks.streamStart.push_back(start);
+            blocks.total += rawSize;
+            pos += payloadSize;
+        }
+        if (headerSize != Deflate::UNKNOWN_SIZE && headerSize != blocks.total - start) throw std::runtime_error("Stream size mismatch");
+    } while (pos < size);
+    return blocks;
+}
+
+static void writeBlockHeader(vector<unsigned char>& out, size_t rawSize, size_t payloadSize) {
+    if (rawSize > UINT32_MAX || payloadSize > UINT32_MAX) throw std::runtime_error("Block too large for its header");
+    putU32(out, static_cast<uint32_t>(rawSize));
+    putU32(out, static_cast<uint32_t>(payloadSize));
+}
+
+// Order-0 entropy of a histogram plus 2 bytes of code table per symbol, for comparing two codings of a block
+static double orderZeroBits(const uint32_t counts[256]) {
+    double total = 0, bits = 0;
+    for (int s = 0; s < 256; ++s) total += counts[s];
+    for (int s = 0; s < 256; ++s) {
+        if (counts[s]) bits += counts[s] * log2(total / counts[s]) + 16;
+    }
+    return bits;
+}
+
+// Quick look at a block before parsing it. A sample with order-0 entropy near 8 bits per byte, and hardly any
+// 4 byte strings that repeat within it, won't get smaller with LZ77 and Huffman (compressed media, encrypted data)
+static bool looksIncompressible(const unsigned char* data, size_t size) {
+    const size_t SLICE = 256, SLICES = 64, HASH_BITS = 12;
+    if (size < 4 * SLICE * SLICES) return false;
+    uint32_t counts[256] = {0};
+    const unsigned char* last[1 << HASH_BITS] = {nullptr};
+    size_t positions = 0, repeats = 0;
+    size_t stride = size / SLICES;
+    for (size_t slice = 0; slice < SLICES; ++slice) {
+        const unsigned char* p = data + slice * stride;
+        Kernels::active().histogram(p, SLICE, counts);
+        for (size_t i = 0; i + 4 <= SLICE; ++i, ++positions) {
+            uint32_t bytes;
+            memcpy(&bytes, p + i, 4);
+            uint32_t h = (bytes * 2654435761u) >> (32 - HASH_BITS);
+            if (last[h] && memcmp(last[h], p + i, 4) == 0) ++repeats;
+            last[h] = p + i;
+        }
+    }
+    double bits = 0, total = SLICE * SLICES;
+    for (int s = 0; s < 256; ++s) {
+        if (counts[s]) bits += counts[s] * log2(total / counts[s]);
+    }
+    return bits / total > 7.8 && repeats * 64 < positions;
+}
+
+CompressionParams CompressionParams::fromLevel(int level) {
+    // {window, chain depth, nice length, lazy, skip trigger}
+    static const int LEVELS[ULTRA_LEVEL][5] = {
+            {4096,  4,     16,    0, 6}, // 1
+            {8192,  8,     32,    0, 6}, // 2
+            {16384, 16,    64,    0, 6}, // 3
+            {32768, 16,    64,    1, 6}, // 4
+            {32768, 32,    128,   1, 6}, // 5
+            {32768, 128,   258,   1, 6}, // 6
+            {32768, 256,   258,   1, 6}, // 7
+            {65535, 1024,  1024,  1, 0}, // 8
+            {65535, 4096,  4096,  1, 0}, // 9
+            {65535, 65535, 65535, 1, 0}, // ultra
+    };
+    level = max(MIN_LEVEL, min(level, int(ULTRA_LEVEL)));
+
+    CompressionParams params;
+    params.matchFinder = MatchFinder::HashChain;
+    params.windowSize = LEVELS[level - 1][0];
+    params.chainDepth = LEVELS[level - 1][1];
+    params.niceLength = LEVELS[level - 1][2];
+    params.parser = LEVELS[level - 1][3] ? Parser::Lazy : Parser::Greedy;
+    params.skipTrigger = LEVELS[level - 1][4];
+    return params;
+}
+
+CompressionParams CompressionParams::automatic(const vector<unsigned char>& input, double targetRatio) {
+    // Sample up to 8 evenly spaced 8KB slices, small inputs are used whole
+    const size_t SLICE = 8192, SLICES = 8;
+    vector<unsigned char> sample;
+    if (input.size() <= SLICE * SLICES) {
+        sample = input;
+    } else {
+        size_t stride = input.size() / SLICES;
+        for (size_t i = 0; i < SLICES; ++i) {
+            sample.insert(sample.end(), input.begin() + i * stride, input.begin() + i * stride + SLICE);
+        }
+    }
+    CompressionParams params = fromLevel(MIN_LEVEL);
+    params.blockSize = max(params.blockSize, min(input.size(), size_t(1) << 24));
+    if (sample.empty()) return params;
+
+    // Order-0 entropy in bits per byte
+    size_t freq[256] = {0};
+    for (unsigned char byte : sample) ++freq[byte];
+    double entropy = 0;
+    for (size_t count : freq) {
+        if (count) entropy -= (double(count) / sample.size()) * log2(double(count) / sample.size());
+    }
+
+    // Repeat density, the share of positions whose next 4 bytes were already seen in the sample
+    vector<uint32_t> seen(1 << 12, 0);
+    size_t repeats = 0;
+    for (size_t i = 0; i + 4 <= sample.size(); ++i) {
+        uint32_t bytes = uint32_t(sample[i]) | (uint32_t(sample[i + 1]) << 8) | (uint32_t(sample[i + 2]) << 16) | (uint32_t(sample[i + 3]) << 24);
+        uint32_t h = (bytes * 2654435761u) >> 20;
+        if (seen[h] == bytes + 1) ++repeats;
+        seen[h] = bytes + 1;
+    }
+    double repeatDensity = double(repeats) / sample.size();
+
+    // Close to random data, no level will do much better than the fastest one
+    if (entropy > 7.5 && repeatDensity < 0.05) return params;
+
+    // Try levels from fastest to slowest on the sample and keep the first that is good enough
+    static const int CANDIDATES[] = {1, 3, 5, 6, 9};
+    Deflate deflate;
+    double bestRatio = 0;
+    CompressionParams best = params;
+    for (int level : CANDIDATES) {
+        CompressionParams candidate = fromLevel(level);
+        candidate.blockSize = params.blockSize;
+        double ratio = double(sample.size()) / deflate.compressBlock(sample.data(), sample.size(), candidate).size();
+        if (ratio >= targetRatio) return candidate;
+        if (ratio > bestRatio) {
+            bestRatio = ratio;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+//// CONTEXTS
+CompressionContext::CompressionContext(MemoryResource* memory) : memory(memory), sequences(memory) {
+    lz.memory = memory;
+}
+
+void CompressionContext::reset() {
+    lz.release_tables();
+    sequences = LZ77Sequences(memory);
+}
+
+size_t CompressionContext::retainedBytes() const {
+    return lz.table_bytes() + sequences.literals.capacity() + 2 * sequences.lengths.capacity() + 2 * sequences.offsets.capacity();
+}
+
+CompressionContext& CompressionContext::forThread() {
+    static thread_local CompressionContext context;
+    return context;
+}
+
+DecompressionContext::DecompressionContext(MemoryResource* memory) : memory(memory), sequences(memory) {
+    lz.memory = memory;
+}
+
+void DecompressionContext::reset() {
+    sequences = LZ77Sequences(memory);
+    vector<unsigned char>().swap(encoded);
+    vector<unsigned char>().swap(huffmanHeader);
+    huffmanTable = HuffmanDecodeTable();
+    vector<unsigned char>().swap(fseHeader);
+    fseTable = FSEDecodeTable();
+}
+
+size_t DecompressionContext::retainedBytes() const {
+    return sequences.literals.capacity() + 2 * sequences.lengths.capacity() + 2 * sequences.offsets.capacity() + encoded.capacity() +
+           huffmanHeader.capacity() + 2 * huffmanTable.entries.capacity() + fseHeader.capacity() +
+           fseTable.entries.capacity() * sizeof(FSEDecodeTable::Entry);
+}
+
+DecompressionContext& DecompressionContext::forThread() {
+    static thread_local DecompressionContext context;
+    return context;
+}
+
+Deflate::Deflate(MemoryResource* memory) : memory(memory) {
+}
+
+void Deflate::lz77Parse(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                        size_t historySize) {
+    TRACE_SCOPE("lz77_parse");
+    LZ77& lz = context.lz;
+    LZ77Sequences& sequences = context.sequences;
+    sequences.clear();
+    if (params.matchFinder == MatchFinder::HashChain) {
+        lz.hash_chain_parse(data, size, params.windowSize, params.chainDepth, params.niceLength, params.parser == Parser::Lazy, sequences,
+                            params.minMatch, params.hashBits, params.skipTrigger, historySize);
+        return;
+    }
+    if (historySize) throw std::runtime_error("Only the hash chain finder parses after a dictionary");
+
+    // The older finders only take a vector and return the byte stream, so they get a copy of the block
+    vector<unsigned char> input(data, data + size);
+    MemoryCharge inputCharge(memory, input.capacity());
+    vector<unsigned char> byteStream;
+    switch (params.matchFinder) {
+        case MatchFinder::BruteForce:
+            byteStream = lz.working_compress(input, params.windowSize);
+            break;
+        case MatchFinder::SuffixArray:
+            byteStream = lz.compress(input, params.windowSize);
+            break;
+        case MatchFinder::Deque:
+            byteStream = lz.deque_compress(input, params.windowSize);
+            break;
+        case MatchFinder::RabinKarp:
+        default:
+            byteStream = lz.rabin_karp_compress(input, params.windowSize);
+            break;
+    }
+    MemoryCharge byteStreamCharge(memory, byteStream.capacity());
+    lz.byteStreamToSequences(byteStream.data(), byteStream.size(), sequences);
+}
+
+vector<unsigned char> Deflate::compressBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionStats* stats) {
+    CompressionContext context(memory);
+    return compressBlock(data, size, params, context, stats);
+}
+
+vector<unsigned char> Deflate::compressBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                                             CompressionStats* stats) {
+    if (size > MAX_BLOCK_SIZE) throw std::runtime_error("Block larger than Deflate::MAX_BLOCK_SIZE");
+    // Incompressible blocks skip the parse, and any block that didn't get smaller goes out stored
+    if (looksIncompressible(data, size)) return storeBlock(data, size, stats);
+    parseBlock(data, size, params, context, stats);
+    vector<unsigned char> payload = encodeBlock(params, context, stats);
+    if (payload.size() > size + 1) return storeBlock(data, size, stats);
+    return payload;
+}
+
+vector<unsigned char> Deflate::storeBlock(const unsigned char* data, size_t size, CompressionStats* stats) {
+    TRACE_SCOPE("store_block");
+    (void)stats; // Only counted with DEFLATE_STATS
+    vector<unsigned char> payload;
+    payload.reserve(size + 1);
+    MemoryCharge payloadCharge(memory, payload.capacity());
+    payload.push_back(STORED_FLAG);
+    payload.insert(payload.end(), data, data + size);
+    DEFLATE_STAT(if (stats) ++stats->storedBlocks);
+    return payload;
+}
+
+vector<unsigned char> Deflate::compressPrimedBlock(const unsigned char* data, size_t size, const unsigned char* reference, uint64_t start,
+                                                   size_t dictionarySize, const CompressionParams& params, CompressionContext& context,
+                                                   CompressionStats* stats) {
+    // The parse needs the dictionary right before the block
+    vector<unsigned char> buffer;
+    buffer.reserve(dictionarySize + size);
+    MemoryCharge bufferCharge(memory, buffer.capacity());
+    buffer.insert(buffer.end(), reference + start, reference + start + dictionarySize);
+    buffer.insert(buffer.end(), data, data + size);
+    parseBlock(buffer.data(), buffer.size(), params, context, stats, dictionarySize);
+    vector<unsigned char> coded = encodeBlock(params, context, stats);
+    if (coded.size() + 12 > size) return storeBlock(data, size, stats);
+
+    vector<unsigned char> payload(1, DICTIONARY_FLAG);
+    payload.reserve(13 + coded.size());
+    MemoryCharge payloadCharge(memory, payload.capacity());
+    putU64(payload, start);
+    putU32(payload, static_cast<uint32_t>(dictionarySize));
+    payload.insert(payload.end(), coded.begin(), coded.end());
+    return payload;
+}
+
+// True for a stored block, whose payload after the flags byte is the block itself
+static bool isStored(const unsigned char* payload, size_t size, uint8_t version) {
+    if (version < 2 || size == 0 || !(payload[0] & Deflate::STORED_FLAG)) return false;
+    if (payload[0] != Deflate::STORED_FLAG) throw std::runtime_error("Invalid stored block");
+    return true;
+}
+
+// True for a reference block, whose payload after the flags byte is the output offset it copies from
+static bool isReference(const unsigned char* payload, size_t size, uint8_t version) {
+    if (version < 2 || size == 0 || !(payload[0] & Deflate::REFERENCE_FLAG)) return false;
+    if (payload[0] != Deflate::REFERENCE_FLAG || size != 9) throw std::runtime_error("Invalid reference block");
+    return true;
+}
+
+// True for a copy from the delta reference, or the empty block that identifies the reference (payload size 17)
+static bool isDelta(const unsigned char* payload, size_t size, uint8_t version) {
+    if (version < 2 || size == 0 || !(payload[0] & Deflate::DELTA_FLAG)) return false;
+    if (payload[0] != Deflate::DELTA_FLAG || (size != 9 && size != 17)) throw std::runtime_error("Invalid delta block");
+    return true;
+}
+
+// True for a delta block coded after a stretch of the reference, a coded block follows its 13 byte header
+static bool isPrimed(const unsigned char* payload, size_t size, uint8_t version) {
+    if (version < 2 || size == 0 || !(payload[0] & Deflate::DICTIONARY_FLAG)) return false;
+    // Only the flags that say how the coded block is read may go with it
+    if (payload[0] != Deflate::DICTIONARY_FLAG || size < 15 || (payload[13] & ~(Deflate::REPEAT_OFFSETS_FLAG | Deflate::SYNC_INDEX_FLAG))) {
+        throw std::runtime_error("Invalid dictionary block");
+    }
+    return true;
+}
+
+void Deflate::parseBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context, CompressionStats* stats,
+                         size_t historySize) {
+    LZ77Sequences& sequences = context.sequences;
+    StageTimer parseTimer(stats, CompressionStats::LZ77_PARSE, size - historySize);
+    DEFLATE_STAT(context.lz.finderStats = MatchFinderStats());
+    // With rep codes on, offsets 1..COUNT name a repeat offset and real offsets are stored + COUNT, so the window
+    // stops COUNT short of the 16 bit range
+    CompressionParams blockParams = params;
+    blockParams.windowSize = min(params.windowSize, MAX_WINDOW_SIZE);
+    lz77Parse(data, size, blockParams, context, historySize);
+    parseTimer.done(sequences.size() * 5);
+#ifdef DEFLATE_STATS
+    if (stats) {
+        stats->positionsSearched += context.lz.finderStats.positionsSearched;
+        stats->candidatesWalked += context.lz.finderStats.candidatesWalked;
+        for (size_t i = 0; i < sequences.size(); ++i) {
+            stats->addToken(sequences.offsets[i], sequences.lengths[i]);
+        }
+    }
+#endif
+}
+
+vector<unsigned char> Deflate::encodeBlock(const CompressionParams& params, CompressionContext& context, CompressionStats* stats) {
+    LZ77& lz = context.lz;
+    Huffman& huff = context.huff;
+    LZ77Sequences& sequences = context.sequences;
+    vector<unsigned char> payload;
+    // Histogram straight off the sequence arrays, the byte stream is only built for the entropy coder
+    StageTimer histogramTimer(stats, CompressionStats::HISTOGRAM, sequences.size() * 5);
+    uint32_t counts[256] = {0};
+    sequences.countBytes(counts);
+
+    // Rep codes pay off when offsets repeat, but shift every other offset by RepeatOffsets::COUNT, which on
+    // small blocks can cost more than it saves. Keep them when the histogram says they are smaller
+    unsigned char blockFlags = 0;
+    uint32_t repeatCounts[256] = {0};
+    size_t repeatMatches = sequences.encodeRepeatOffsets();
+    sequences.countBytes(repeatCounts);
+    if (repeatMatches > 0 && orderZeroBits(repeatCounts) < orderZeroBits(counts)) {
+        blockFlags |= REPEAT_OFFSETS_FLAG;
+        copy(repeatCounts, repeatCounts + 256, counts);
+        DEFLATE_STAT(if (stats) stats->repeatMatches += repeatMatches);
+    } else {
+        sequences.decodeRepeatOffsets();
+    }
+    unordered_map<unsigned char, int> freq;
+    for (int byte = 0; byte < 256; ++byte) {
+        if (counts[byte]) freq[static_cast<unsigned char>(byte)] = static_cast<int>(counts[byte]);
+    }
+    histogramTimer.done(0);
+
+    StageTimer treeTimer(stats, CompressionStats::TREE_BUILD, 0);
+    const size_t symbols = sequences.size() * 5;
+    bool useFse = false;
+    int tableLog = 0;
+    vector<uint16_t> normalized;
+    if (params.entropyCoder != EntropyCoder::Huffman && symbols > 0) {
+        tableLog = FSE::optimalTableLog(symbols, static_cast<int>(freq.size()));
+        normalized = FSE::normalizeCounts(counts, tableLog);
+        useFse = params.entropyCoder == EntropyCoder::FSE;
+    }
+
+    unordered_map<unsigned char, string> huffmanCodes;
+    shared_ptr<const StaticHuffmanTable> staticTable;
+    if (!useFse) {
+        staticTable = huff.selectStaticTable(freq, 2, context.sharedTable); // (byte, length) per code
+        if (staticTable) {
+            payload.push_back(staticTable->id);
+            huffmanCodes = staticTable->codes;
+        } else {
+            // Canonical codes only need their lengths stored
+            unordered_map<unsigned char, string> treeCodes = huff.generateHuffmanCodes(freq);
+            vector<pair<unsigned char, int>> codeLengths;
+            for (const auto& pair : treeCodes) {
+                codeLengths.push_back(make_pair(pair.first, static_cast<int>(pair.second.size())));
+            }
+            huffmanCodes = Huffman::canonicalCodes(codeLengths);
+
+            payload.push_back(0);
+            putU16(payload, static_cast<uint16_t>(huffmanCodes.size()));
+            for (const auto& pair : huffmanCodes) {
+                payload.push_back(pair.first);
+                payload.push_back(static_cast<unsigned char>(pair.second.size()));
+            }
+        }
+        if (!normalized.empty()) {
+            // Header, coded bits and trailer of each, the tANS header has 3 bytes per symbol and ends with its final states
+            double huffmanBits = 8.0 * (payload.size() + 1) + Huffman::encodedBits(freq, huffmanCodes);
+            double fseBits = 8.0 * (8 + 3 * freq.size()) + FSE::estimateBits(counts, normalized, tableLog) + FSE::STATES * tableLog + 8;
+            useFse = fseBits < huffmanBits;
+        }
+    }
+
+    if (useFse) {
+        payload.clear();
+        payload.push_back(FSE_TABLE_ID);
+        payload.push_back(static_cast<unsigned char>(tableLog));
+        putU16(payload, static_cast<uint16_t>(freq.size()));
+        for (int byte = 0; byte < 256; ++byte) {
+            if (!normalized[byte]) continue;
+            payload.push_back(static_cast<unsigned char>(byte));
+            putU16(payload, normalized[byte]);
+        }
+        putU32(payload, static_cast<uint32_t>(symbols));
+        DEFLATE_STAT(if (stats) ++stats->fseTablesBuilt);
+    } else if (staticTable) {
+        DEFLATE_STAT(if (stats) ++stats->staticTablesUsed);
+    } else {
+        DEFLATE_STAT(if (stats) ++stats->huffmanTablesBuilt);
+    }
+    treeTimer.done(payload.size());
+
+    vector<unsigned char> tokens = lz.sequencesToByteStream(sequences);
+    MemoryCharge tokensCharge(memory, tokens.capacity());
+    StageTimer encodeTimer(stats, CompressionStats::HUFFMAN_ENCODE, tokens.size());
+    vector<unsigned char> encoded = useFse ? context.fse.encode(tokens.data(), tokens.size(), FSE::buildEncodeTable(normalized, tableLog))
+                                           : huff.encode(tokens, huffmanCodes);
+    MemoryCharge encodedCharge(memory, encoded.capacity());
+    // Offsets are 32 bit, so only blocks under 512MB coded get an index
+    if (!useFse && params.syncInterval > 0 && symbols > params.syncInterval && encoded.size() < (size_t(1) << 29)) {
+        // Bit offset of every interval'th symbol, summed from the code lengths
+        size_t codeLength[256] = {0};
+        for (const auto& pair : huffmanCodes) codeLength[pair.first] = pair.second.size();
+        vector<uint32_t> syncPoints;
+        uint64_t bit = 0;
+        for (size_t i = 0; i < symbols; ++i) {
+            if (i > 0 && i % params.syncInterval == 0) syncPoints.push_back(static_cast<uint32_t>(bit));
+            bit += codeLength[tokens[i]];
+        }
+        putU32(payload, static_cast<uint32_t>(symbols));
+        putU32(payload, static_cast<uint32_t>(params.syncInterval));
+        putU32(payload, static_cast<uint32_t>(syncPoints.size()));
+        for (uint32_t point : syncPoints) putU32(payload, point);
+        blockFlags |= SYNC_INDEX_FLAG;
+    }
+    encodeTimer.done(encoded.size());
+#ifdef DEFLATE_STATS
+    if (stats) {
+        stats->codedSymbols += symbols;
+        stats->codedBits += useFse ? 8 * encoded.size() : Huffman::encodedBits(freq, huffmanCodes);
+    }
+#endif
+    payload.insert(payload.begin(), blockFlags);
+    payload.reserve(payload.size() + encoded.size());
+    MemoryCharge payloadCharge(memory, payload.capacity());
+    payload.insert(payload.end(), encoded.begin(), encoded.end());
+    return payload;
+}
+
+vector<unsigned char> Deflate::decompressBlock(const unsigned char* payload, size_t size, CompressionStats* stats, uint8_t version) {
+    DecompressionContext context(memory);
+    return decompressBlock(payload, size, context, stats, version);
+}
+
+// Longest code a block header may give. A Huffman tree only gets this deep with Fibonacci counts summing to over 2^38
+// tokens, far more than a MAX_BLOCK_SIZE block holds, and it keeps the 64 bit arithmetic of canonicalCodes defined
+static const int MAX_CODE_LENGTH = 56;
+
+// Rejects code lengths that canonicalCodes would turn into overlapping codes: a byte given twice, a length of 0 or
+// above MAX_CODE_LENGTH, or more codes than the lengths have room for. An incomplete set, as with one byte, is fine
+static void checkCodeLengths(const unsigned char* header, size_t count) {
+    bool seen[256] = {};
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char byte = header[2 * i];
+        int length = header[2 * i + 1];
+        if (seen[byte] || length == 0 || length > MAX_CODE_LENGTH) throw std::runtime_error("Invalid Huffman code lengths");
+        seen[byte] = true;
+        kraft += uint64_t(1) << (MAX_CODE_LENGTH - length);
+    }
+    if (kraft > uint64_t(1) << MAX_CODE_LENGTH) throw std::runtime_error("Invalid Huffman code lengths");
+}
+
+// True when the code table header at header..header+size is the one the cached table was built from
+static bool sameHeader(const vector<unsigned char>& cached, const unsigned char* header, size_t size) {
+    return cached.size() == size && equal(cached.begin(), cached.end(), header);
+}
+
+vector<unsigned char> Deflate::decompressBlock(const unsigned char* payload, size_t size, DecompressionContext& context,
+                                               CompressionStats* stats, uint8_t version, int threads, size_t rawSize,
+                                               const ByteSpan* history) {
+    if (isStored(payload, size, version)) return vector<unsigned char>(payload + 1, payload + size);
+    if (isReference(payload, size, version) || isDelta(payload, size, version) || isPrimed(payload, size, version)) {
+        throw std::runtime_error("A reference block can't be decoded on its own");
+    }
+    StageTimer decodeTimer(stats, CompressionStats::HUFFMAN_DECODE, size);
+    vector<unsigned char> tokens;
+    bool repeatOffsets = false;
+    const HuffmanDecodeTable* flatTable = entropyDecode(payload, size, context, stats, version, threads, rawSize, tokens, repeatOffsets);
+    if (flatTable) {
+        // One pass from the Huffman bits to the output, the LZ77 expand stage is part of it
+        vector<unsigned char> output = inflateHuffman(context.encoded, *flatTable, repeatOffsets, rawSize, history);
+        decodeTimer.done(output.size());
+        return output;
+    }
+    decodeTimer.done(tokens.size());
+    MemoryCharge tokensCharge(memory, context.encoded.capacity() + tokens.capacity());
+
+    StageTimer expandTimer(stats, CompressionStats::LZ77_EXPAND, tokens.size());
+    LZ77Sequences& sequences = context.sequences;
+    sequences.clear();
+    context.lz.byteStreamToSequences(tokens.data(), tokens.size(), sequences);
+    if (repeatOffsets) sequences.decodeRepeatOffsets();
+    vector<unsigned char> output = history ? context.lz.decompressToBytes(sequences, history->data, history->size)
+                                           : context.lz.decompressToBytes(sequences);
+    expandTimer.done(output.size());
+    return output;
+}
+
+const HuffmanDecodeTable* Deflate::entropyDecode(const unsigned char* payload, size_t size, DecompressionContext& context,
+                                                 CompressionStats* stats, uint8_t version, int threads, size_t rawSize,
+                                                 vector<unsigned char>& tokens, bool& repeatOffsets) {
+    (void)stats; // Only counted with DEFLATE_STATS
+    if (size < (version >= 2 ? 2 : 1)) throw std::runtime_error("Truncated block");
+    size_t pos = 0;
+    unsigned char blockFlags = version >= 2 ? payload[pos++] : 0;
+    unsigned char tableId = payload[pos++];
+    if (blockFlags & ~(REPEAT_OFFSETS_FLAG | SYNC_INDEX_FLAG)) throw std::runtime_error("Unknown block flags");
+    if ((blockFlags & SYNC_INDEX_FLAG) && tableId == FSE_TABLE_ID) throw std::runtime_error("Sync index on a tANS block");
+    repeatOffsets = (blockFlags & REPEAT_OFFSETS_FLAG) != 0;
+
+    // Reads the sync index, if the block has one, from the front of the Huffman data
+    size_t syncSymbols = 0, syncInterval = 0;
+    vector<uint32_t> syncPoints;
+    auto readSyncIndex = [&]() {
+        if (!(blockFlags & SYNC_INDEX_FLAG)) return;
+        if (size < pos + 12) throw std::runtime_error("Truncated block");
+        syncSymbols = getU32(payload + pos);
+        syncInterval = getU32(payload + pos + 4);
+        size_t count = getU32(payload + pos + 8);
+        pos += 12;
+        if (size < pos || (size - pos) / 4 < count) throw std::runtime_error("Truncated block");
+        if (syncInterval == 0 || count != (syncSymbols - 1) / syncInterval) throw std::runtime_error("Invalid sync index");
+        for (size_t i = 0; i < count; ++i, pos += 4) syncPoints.push_back(getU32(payload + pos));
+        // Every symbol takes at least a bit
+        if (syncSymbols > 8 * (size - pos)) throw std::runtime_error("Invalid sync index");
+    };
+
+    Huffman& huff = context.huff;
+    vector<unsigned char>& encoded = context.encoded;
+    encoded.clear();
+    tokens.clear();
+    // Set when the Huffman data is decoded with a flat table, after the table header is read
+    const HuffmanDecodeTable* flatTable = nullptr;
+    if (tableId == FSE_TABLE_ID) {
+        if (size < pos + 3) throw std::runtime_error("Truncated block");
+        int tableLog = payload[pos++];
+        size_t count = getU16(payload + pos);
+        pos += 2;
+        if (size < pos + 3 * count + 4) throw std::runtime_error("Truncated block");
+        if (!sameHeader(context.fseHeader, payload + pos - 3, 3 + 3 * count)) {
+            vector<uint16_t> normalized(256, 0);
+            for (size_t i = 0; i < count; ++i) {
+                normalized[payload[pos + 3 * i]] = getU16(payload + pos + 3 * i + 1);
+            }
+            context.fseHeader.clear();
+            context.fseTable = FSE::buildDecodeTable(normalized, tableLog);
+            context.fseHeader.assign(payload + pos - 3, payload + pos + 3 * count);
+            DEFLATE_STAT(if (stats) ++stats->fseTablesBuilt);
+        }
+        pos += 3 * count;
+        size_t symbols = getU32(payload + pos);
+        pos += 4;
+        if (symbols % 5 != 0) throw std::runtime_error("Invalid tANS block");
+        // A 5 byte token decodes to at least its literal, plus the older finders' pad byte. A symbol can cost far less
+        // than a bit, so only this keeps a short block from claiming gigabytes of tokens
+        if (symbols / 5 > (rawSize ? rawSize : MAX_BLOCK_SIZE) + 1) throw std::runtime_error("Invalid tANS block");
+        tokens = context.fse.decode(payload + pos, size - pos, symbols, context.fseTable);
+    } else if (tableId != 0) {
+        shared_ptr<const StaticHuffmanTable> table = Huffman::findTable(tableId);
+        if (!table) throw std::runtime_error("Unknown static Huffman table");
+        readSyncIndex();
+        encoded.assign(payload + pos, payload + size);
+        flatTable = &table->decodeTable;
+    } else {
+        if (size < pos + 2) throw std::runtime_error("Truncated block");
+        size_t count = getU16(payload + pos);
+        pos += 2;
+        if (size < pos + 2 * count) throw std::runtime_error("Truncated block");
+        const unsigned char* header = payload + pos;
+        pos += 2 * count;
+        readSyncIndex();
+        encoded.assign(payload + pos, payload + size);
+
+        // Flat table when the codes are short enough, otherwise the trie, which isn't kept
+        if (sameHeader(context.huffmanHeader, header - 2, 2 + 2 * count)) {
+            flatTable = &context.huffmanTable;
+        } else {
+            checkCodeLengths(header, count);
+            vector<pair<unsigned char, int>> codeLengths;
+            for (size_t i = 0; i < count; ++i) {
+                codeLengths.push_back(make_pair(header[2 * i], static_cast<int>(header[2 * i + 1])));
+            }
+            unordered_map<unsigned char, string> huffmanCodes = Huffman::canonicalCodes(codeLengths);
+            context.huffmanHeader.clear();
+            context.huffmanTable = Huffman::buildDecodeTable(huffmanCodes);
+            if (context.huffmanTable.maxLength) {
+                context.huffmanHeader.assign(header - 2, header + 2 * count);
+                flatTable = &context.huffmanTable;
+            } else {
+                TrieNode* root = huff.buildTrie(huffmanCodes);
+                tokens = huff.decode(encoded, root);
+                Huffman::deleteTrie(root);
+            }
+            DEFLATE_STAT(if (stats) ++stats->huffmanTablesBuilt);
+        }
+    }
+    if (flatTable && !syncInterval) return flatTable;
+    if (flatTable) tokens = decodeSynced(encoded, *flatTable, syncSymbols, syncInterval, syncPoints, threads);
+    return nullptr;
+}
+
+//// BATCH
+// Inputs are handed to threads in runs of this many, each run shares one context
+static const size_t BATCH_RUN = 64;
+
+unordered_map<unsigned char, string> Deflate::batchCodes(const vector<uint32_t>& counts) {
+    // Every byte gets a code, and counts are halved until the longest code fits in a static table
+    vector<uint64_t> scaled(counts.begin(), counts.end());
+    while (true) {
+        unordered_map<unsigned char, int> freq;
+        for (int byte = 0; byte < 256; ++byte) {
+            freq[static_cast<unsigned char>(byte)] = static_cast<int>(min<uint64_t>(scaled[byte] + 1, INT32_MAX / 256));
+        }
+        Huffman huff;
+        unordered_map<unsigned char, string> codes = huff.generateHuffmanCodes(freq);
+        bool fits = true;
+        for (const auto& pair : codes) fits = fits && pair.second.size() <= size_t(HuffmanDecodeTable::MAX_LENGTH);
+        if (fits) return codes;
+        for (uint64_t& count : scaled) count /= 2;
+    }
+}
+
+Deflate::BatchResult Deflate::compressBatch(const vector<ByteSpan>& inputs, const CompressionParams& params, unsigned char sharedTableId,
+                                            CompressionStats* stats) {
+    TRACE_SCOPE("compress_batch");
+    // Outputs of an earlier batch decode with whatever the id holds, so it is never replaced here
+    if (sharedTableId != 0 && Huffman::findTable(sharedTableId)) {
+        throw std::runtime_error("Huffman table id " + to_string(sharedTableId) + " is in use, unregister it or pick another");
+    }
+    BatchResult result;
+    result.outputs.resize(inputs.size());
+    CompressionParams inputParams = fitMemoryLimit(params);
+    inputParams.threads = 1;
+    size_t blockSize = max(inputParams.blockSize, size_t(1));
+    size_t runs = (inputs.size() + BATCH_RUN - 1) / BATCH_RUN;
+    vector<CompressionStats> runStats(stats ? runs : 0);
+    auto runRange = [&](size_t run, const function<void(size_t, CompressionContext&, CompressionStats*)>& task) {
+        CompressionContext context(memory);
+        for (size_t i = run * BATCH_RUN; i < min(inputs.size(), (run + 1) * BATCH_RUN); ++i) {
+            task(i, context, stats ? &runStats[run] : nullptr);
+        }
+    };
+    // Inputs that fit in one block take the shared table path, the rest are compressed as they are
+    auto singleBlock = [&](size_t i) { return sharedTableId != 0 && inputs[i].size > 0 && inputs[i].size <= blockSize; };
+
+    // Parse the single block inputs first and keep their sequences and histograms for the table
+    vector<LZ77Sequences> parsed;
+    vector<vector<uint32_t>> counts;
+    if (sharedTableId != 0) {
+        parsed.assign(inputs.size(), LZ77Sequences(memory));
+        counts.assign(inputs.size(), vector<uint32_t>());
+        parallelFor(runs, params.threads, [&](size_t run) {
+            runRange(run, [&](size_t i, CompressionContext& context, CompressionStats* runStat) {
+                if (!singleBlock(i)) return;
+                parseBlock(inputs[i].data, inputs[i].size, inputParams, context, runStat);
+                counts[i].assign(256, 0);
+                context.sequences.countBytes(counts[i].data());
+                swap(parsed[i], context.sequences);
+            });
+        });
+
+        // Keep the table if it beats the smallest possible dynamic tables, or storing, summed over the inputs
+        vector<uint32_t> total(256, 0);
+        size_t singles = 0;
+        for (const vector<uint32_t>& c : counts) {
+            if (c.empty()) continue;
+            ++singles;
+            for (int byte = 0; byte < 256; ++byte) total[byte] += c[byte];
+        }
+        if (singles > 1) {
+            unordered_map<unsigned char, string> codes = batchCodes(total);
+            double sharedBits = 0, dynamicBits = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                const vector<uint32_t>& c = counts[i];
+                if (c.empty()) continue;
+                unordered_map<unsigned char, int> freq;
+                for (int byte = 0; byte < 256; ++byte) {
+                    if (c[byte]) freq[static_cast<unsigned char>(byte)] = static_cast<int>(c[byte]);
+                }
+                size_t dynamic = min(Huffman::dynamicLowerBoundBits(freq, 2), 8 * (inputs[i].size + 1));
+                sharedBits += min(Huffman::encodedBits(freq, codes), dynamic);
+                dynamicBits += dynamic;
+            }
+            if (sharedBits < dynamicBits) result.table = Huffman::registerTable(sharedTableId, codes, false);
+        }
+    }
+
+    parallelFor(runs, params.threads, [&](size_t run) {
+        runRange(run, [&](size_t i, CompressionContext& context, CompressionStats* runStat) {
+            if (!singleBlock(i)) {
+                result.outputs[i] = compressWith(inputs[i].data, inputs[i].size, inputParams, &context, runStat);
+                return;
+            }
+            swap(context.sequences, parsed[i]);
+            context.sharedTable = result.table;
+            vector<unsigned char> payload = encodeBlock(inputParams, context, runStat);
+            context.sharedTable.reset();
+            if (payload.size() > inputs[i].size + 1) payload = storeBlock(inputs[i].data, inputs[i].size, runStat);
+            vector<unsigned char>& output = result.outputs[i];
+            output.reserve(5 + 8 + payload.size());
+            writeStreamHeader(output, inputs[i].size);
+            writeBlockHeader(output, inputs[i].size, payload.size());
+            output.insert(output.end(), payload.begin(), payload.end());
+            parsed[i] = LZ77Sequences(memory);
+        });
+    });
+    for (const CompressionStats& s : runStats) stats->merge(s);
+    return result;
+}
+
+vector<vector<unsigned char>> Deflate::decompressBatch(const vector<ByteSpan>& inputs, int threads, CompressionStats* stats) {
+    TRACE_SCOPE("decompress_batch");
+    vector<vector<unsigned char>> outputs(inputs.size());
+    size_t runs = (inputs.size() + BATCH_RUN - 1) / BATCH_RUN;
+    vector<CompressionStats> runStats(stats ? runs : 0);
+    parallelFor(runs, threads, [&](size_t run) {
+        DecompressionContext context(memory);
+        for (size_t i = run * BATCH_RUN; i < min(inputs.size(), (run + 1) * BATCH_RUN); ++i) {
+            outputs[i] = decompressWith(inputs[i].data, inputs[i].size, 1, &context, stats ? &runStats[run] : nullptr);
+        }
+    });
+    for (const CompressionStats& s : runStats) stats->merge(s);
+    return outputs;
+}
+
+// Bit reader of inflateHuffman. Bits are left aligned in buffer, which past a refill holds at least 56 of them
+// while the input lasts, enough for three symbols of up to HuffmanDecodeTable::MAX_LENGTH bits
+struct InflateReader {
+    const unsigned char* input;
+    size_t size;
+    size_t bytePos;
+    uint64_t buffer;
+    int count;
+    size_t bitsRead;
+
+    bool fast() const { return bytePos + 8 <= size; }
+    void refill() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (fast()) {
+            // Eight bytes in one load, only the whole bytes that fit are counted as read
+            uint64_t word;
+            memcpy(&word, input + bytePos, 8);
+            buffer |= __builtin_bswap64(word) >> count;
+            bytePos += (63 - count) >> 3;
+            count |= 56;
+            return;
+        }
+#endif
+        while (count <= 56 && bytePos < size) {
+            buffer |= static_cast<uint64_t>(input[bytePos++]) << (56 - count);
+            count += 8;
+        }
+    }
+    unsigned symbol(const uint16_t* entries, int maxLength) {
+        uint16_t entry = entries[buffer >> (64 - maxLength)];
+        int length = entry & 0xFF;
+        if (length == 0 || length > count) throw std::runtime_error("Invalid Huffman code");
+        buffer <<= length;
+        count -= length;
+        bitsRead += length;
+        return entry >> 8;
+    }
+};
+
+vector<unsigned char> Deflate::inflateHuffman(const vector<unsigned char>& encoded, const HuffmanDecodeTable& table, bool repeatOffsets,
+                                              size_t rawSize, const ByteSpan* history) {
+    TRACE_SCOPE("inflate_huffman");
+    vector<unsigned char> output;
+    if (encoded.size() < 2) return output;
+    // Matches may reach back into the history, which is decoded after and dropped at the end
+    const size_t historySize = history ? history->size : 0;
+    // Same layout as Huffman::decode reads: data bytes, then the number of valid bits in the last one
+    InflateReader reader = {encoded.data(), encoded.size() - 1, 0, 0, 0, 0};
+    const size_t totalBits = 8 * (reader.size - 1) + encoded.back();
+    const uint16_t* entries = table.entries.data();
+    const int maxLength = table.maxLength;
+    void (*copyMatch)(unsigned char*, size_t, size_t) = Kernels::active().copyMatch;
+    RepeatOffsets repeats;
+
+    // Never more than the raw size plus the byte the older finders may add, or without a raw size the largest block
+    // a writer produces, so a payload of long matches is rejected before it can allocate any further
+    const size_t limit = historySize + (rawSize ? rawSize : MAX_BLOCK_SIZE) + 1;
+    // Grown as needed, with the copy kernel's slack kept past the end
+    output.resize((rawSize ? limit : min(historySize + 4 * encoded.size(), limit)) + Kernels::COPY_SLACK);
+    unsigned char* out = output.data();
+    if (historySize) memcpy(out, history->data, historySize);
+    size_t pos = historySize;
+    while (reader.bitsRead < totalBits) {
+        // A token is five symbols, two refills cover them
+        reader.refill();
+        unsigned offset = reader.symbol(entries, maxLength);
+        offset |= reader.symbol(entries, maxLength) << 8;
+        size_t length = reader.symbol(entries, maxLength);
+        reader.refill();
+        length |= reader.symbol(entries, maxLength) << 8;
+        unsigned char literal = static_cast<unsigned char>(reader.symbol(entries, maxLength));
+        if (reader.bitsRead > totalBits) throw std::runtime_error("Truncated Huffman data");
+
+        if (pos + length + 1 > limit) throw std::runtime_error("Block decodes past its raw size");
+        if (pos + length + 1 + Kernels::COPY_SLACK > output.size()) {
+            output.resize(min(max(2 * output.size(), pos + length + 1), limit) + Kernels::COPY_SLACK);
+            out = output.data();
+        }
+        if (length > 0) {
+            if (repeatOffsets) {
+                if (offset == 0) throw std::runtime_error("Invalid LZ77 token");
+                offset = offset <= unsigned(RepeatOffsets::COUNT) ? repeats.offsets[offset - 1] : offset - RepeatOffsets::COUNT;
+                repeats.use(offset);
+            }
+            if (offset == 0 || offset > pos) throw std::runtime_error("Invalid LZ77 token");
+            copyMatch(out + pos, offset, length);
+            pos += length;
+        }
+        out[pos++] = literal;
+    }
+    output.resize(pos);
+    output.erase(output.begin(), output.begin() + historySize);
+    return output;
+}
+
+vector<unsigned char> Deflate::decodeSynced(const vector<unsigned char>& encoded, const HuffmanDecodeTable& table, size_t symbols,
+                                           size_t interval, const vector<uint32_t>& syncPoints, int threads) {
+    TRACE_SCOPE("huffman_decode_synced");
+    vector<unsigned char> tokens(symbols);
+    parallelFor(syncPoints.size() + 1, threads, [&](size_t run) {
+        size_t start = run * interval;
+        size_t startBit = run == 0 ? 0 : syncPoints[run - 1];
+        size_t end = Huffman::decodeRange(encoded, startBit, min(interval, symbols - start), table, tokens.data() + start);
+        // Each run has to finish exactly where the next one starts
+        if (end == SIZE_MAX || (run < syncPoints.size() && end != syncPoints[run])) {
+            throw std::runtime_error("Huffman data doesn't match its sync index");
+        }
+    });
+    return tokens;
+}
+
+//// STREAMING DECODE
+// Output side of decompressStream. The current block's history lives in a window buffer: matches copy within it with
+// the copy kernel, full chunks go to the sink, and once the end is near the last MAX_WINDOW_SIZE bytes slide to the front.
+// A byte is always held back, for the pad byte of the older match finders
+class WindowWriter {
+public:
+    WindowWriter(MemoryResource* memory, size_t chunkSize, const function<void(const unsigned char*, size_t)>& sink)
+            : buffer(HISTORY + chunkSize + MAX_TOKEN + Kernels::COPY_SLACK, 0, TrackedAllocator<unsigned char>(memory)),
+              chunkSize(chunkSize), sink(sink), copyMatch(Kernels::active().copyMatch) {}
+
+    void token(size_t offset, size_t length, unsigned char literal) {
+        if (pos + MAX_TOKEN + Kernels::COPY_SLACK > buffer.size()) slide();
+        unsigned char* out = buffer.data();
+        if (length > 0) {
+            if (offset == 0 || offset > blockPos) throw std::runtime_error("Invalid LZ77 token");
+            copyMatch(out + pos, offset, length);
+            pos += length;
+        }
+        out[pos++] = literal;
+        blockPos += length + 1;
+        flushChunks();
+    }
+    // A stored block's bytes, in pieces that fit the buffer
+    void raw(const unsigned char* data, size_t size) {
+        while (size > 0) {
+            size_t piece = min(size, MAX_TOKEN);
+            if (pos + piece + Kernels::COPY_SLACK > buffer.size()) slide();
+            memcpy(buffer.data() + pos, data, piece);
+            pos += piece;
+            blockPos += piece;
+            data += piece;
+            size -= piece;
+            flushChunks();
+        }
+    }
+    // Blocks don't share history. The older finders may have decoded one byte past rawSize
+    void endBlock(size_t rawSize) {
+        if (blockPos < rawSize || blockPos > rawSize + 1) throw std::runtime_error("Block size mismatch");
+        pos -= blockPos - rawSize;
+        total += rawSize;
+        blockPos = 0;
+    }
+    void finish() {
+        if (pos > flushed) sink(buffer.data() + flushed, pos - flushed);
+        flushed = pos;
+    }
+    uint64_t written() const { return total; }
+
+private:
+    static const size_t HISTORY = UINT16_MAX;
+    static const size_t MAX_TOKEN = UINT16_MAX + 1;
+
+    void flushChunks() {
+        while (pos - flushed > chunkSize) {
+            sink(buffer.data() + flushed, chunkSize);
+            flushed += chunkSize;
+        }
+    }
+    void slide() {
+        size_t start = min(flushed, pos - min(pos, HISTORY));
+        memmove(buffer.data(), buffer.data() + start, pos - start);
+        pos -= start;
+        flushed -= start;
+    }
+
+    TrackedVector<unsigned char> buffer;
+    size_t chunkSize;
+    const function<void(const unsigned char*, size_t)>& sink;
+    void (*copyMatch)(unsigned char*, size_t, size_t);
+    size_t pos = 0, flushed = 0, blockPos = 0;
+    uint64_t total = 0;
+};
+
+const size_t WindowWriter::HISTORY;
+const size_t WindowWriter::MAX_TOKEN;
+
+// Token at a time versions of inflateHuffman and the LZ77 expand stage, into a WindowWriter
+static void streamHuffman(const vector<unsigned char>& encoded, const HuffmanDecodeTable& table, bool repeatOffsets, WindowWriter& writer) {
+    TRACE_SCOPE("stream_huffman");
+    if (encoded.size() < 2) return;
+    InflateReader reader = {encoded.data(), encoded.size() - 1, 0, 0, 0, 0};
+    const size_t totalBits = 8 * (reader.size - 1) + encoded.back();
+    const uint16_t* entries = table.entries.data();
+    const int maxLength = table.maxLength;
+    RepeatOffsets repeats;
+    while (reader.bitsRead < totalBits) {
+        reader.refill();
+        unsigned offset = reader.symbol(entries, maxLength);
+        offset |= reader.symbol(entries, maxLength) << 8;
+        size_t length = reader.symbol(entries, maxLength);
+        reader.refill();
+        length |= reader.symbol(entries, maxLength) << 8;
+        unsigned char literal = static_cast<unsigned char>(reader.symbol(entries, maxLength));
+        if (reader.bitsRead > totalBits) throw std::runtime_error("Truncated Huffman data");
+        if (length > 0 && repeatOffsets) {
+            if (offset == 0) throw std::runtime_error("Invalid LZ77 token");
+            offset = offset <= unsigned(RepeatOffsets::COUNT) ? repeats.offsets[offset - 1] : offset - RepeatOffsets::COUNT;
+            repeats.use(offset);
+        }
+        writer.token(offset, length, literal);
+    }
+}
+
+static void streamTokens(const vector<unsigned char>& tokens, bool repeatOffsets, WindowWriter& writer) {
+    TRACE_SCOPE("stream_tokens");
+    if (tokens.size() % 5 != 0) throw std::runtime_error("Invalid LZ77 token stream");
+    RepeatOffsets repeats;
+    for (size_t i = 0; i < tokens.size(); i += 5) {
+        unsigned offset = tokens[i] | (tokens[i + 1] << 8);
+        size_t length = tokens[i + 2] | (tokens[i + 3] << 8);
+        if (length > 0 && repeatOffsets) {
+            if (offset == 0) throw std::runtime_error("Invalid LZ77 token");
+            offset = offset <= unsigned(RepeatOffsets::COUNT) ? repeats.offsets[offset - 1] : offset - RepeatOffsets::COUNT;
+            repeats.use(offset);
+        }
+        writer.token(offset, length, tokens[i + 4]);
+    }
+}
+
+void Deflate::parallelFor(size_t count, int threads, const function<void(size_t)>& task) {
+    size_t workerCount = min(count, static_cast<size_t>(max(threads, 1)));
+    if (workerCount <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            TRACE_SCOPE("block");
+            task(i);
+        }
+        return;
+    }
+    atomic<size_t> next(0);
+    vector<exception_ptr> errors(workerCount);
+    vector<thread> workers;
+    for (size_t w = 0; w < workerCount; ++w) {
+        workers.push_back(thread([&, w]() {
+            TRACE_SCOPE("worker");
+            try {
+                for (size_t i = next++; i < count; i = next++) {
+                    TRACE_SCOPE("block");
+                    task(i);
+                }
+            } catch (...) {
+                // Hand the error back to the calling thread instead of terminating
+                errors[w] = current_exception();
+                next = count;
+            }
+        }));
+    }
+    TRACE_SCOPE("join_workers");
+    for (thread& worker : workers) worker.join();
+    for (const exception_ptr& error : errors) {
+        if (error) rethrow_exception(error);
+    }
+}
+
+size_t Deflate::estimateWorkingMemory(const CompressionParams& params) {
+    // Worst case per block in flight is all literals: the token list and 5 byte token stream while parsing,
+    // then the Huffman coding and payload, plus the hash chain head and prev tables
+    size_t blockSize = max(params.blockSize, size_t(1));
+    size_t ring = 1;
+    while (ring < size_t(params.windowSize) && ring < blockSize) ring <<= 1;
+    size_t perBlock = 16 * blockSize + 4 * (size_t(1) << params.hashBits) + 4 * ring;
+    // Streaming also holds the input of every block in flight
+    return max(params.threads, 1) * (perBlock + blockSize);
+}
+
+CompressionParams Deflate::fitMemoryLimit(CompressionParams params) {
+    params.blockSize = min(max(params.blockSize, size_t(1)), MAX_BLOCK_SIZE);
+    if (params.memoryLimit == 0) return params;
+    // Give up parallelism first, then block size, then window
+    while (params.threads > 1 && estimateWorkingMemory(params) > params.memoryLimit) --params.threads;
+    while (params.blockSize > MIN_BLOCK_SIZE && estimateWorkingMemory(params) > params.memoryLimit) params.blockSize /= 2;
+    while (params.windowSize > 1024 && estimateWorkingMemory(params) > params.memoryLimit) params.windowSize /= 2;
+    return params;
+}
+
+void Deflate::compressBlocks(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                             CompressionStats* stats, const function<void(const vector<unsigned char>&, size_t)>& write) {
+    size_t blockSize = max(params.blockSize, size_t(1));
+    size_t blockCount = (size + blockSize - 1) / blockSize;
+    // With a memory limit only one block per thread is in flight, written out before the next wave starts
+    size_t wave = params.memoryLimit ? static_cast<size_t>(max(params.threads, 1)) : max(blockCount, size_t(1));
+
+    for (size_t first = 0; first < blockCount; first += wave) {
+        size_t count = min(wave, blockCount - first);
+        vector<vector<unsigned char>> payloads(count);
+        vector<CompressionStats> blockStats(stats ? count : 0);
+        bool serial = params.threads <= 1 || count <= 1;
+        parallelFor(count, params.threads, [&](size_t i) {
+            size_t start = (first + i) * blockSize;
+            CompressionStats* taskStats = stats ? &blockStats[i] : nullptr;
+            if (serial) {
+                payloads[i] = compressBlock(data + start, min(blockSize, size - start), params, context, taskStats);
+            } else {
+                // A context per task keeps the workers from sharing any state
+                CompressionContext taskContext(memory);
+                payloads[i] = compressBlock(data + start, min(blockSize, size - start), params, taskContext, taskStats);
+            }
+            memory->charge(payloads[i].capacity());
+        });
+        for (const CompressionStats& s : blockStats) stats->merge(s);
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t start = (first + i) * blockSize;
+            write(payloads[i], min(blockSize, size - start));
+            memory->release(payloads[i].capacity());
+            vector<unsigned char>().swap(payloads[i]);
+        }
+    }
+}
+
+vector<unsigned char> Deflate::compress(const vector<unsigned char>& input, const CompressionParams& params, CompressionStats* stats) {
+    return compressWith(input.data(), input.size(), params, nullptr, stats);
+}
+
+vector<unsigned char> Deflate::compress(const vector<unsigned char>& input, const CompressionParams& params, CompressionContext& context,
+                                        CompressionStats* stats) {
+    return compressWith(input.data(), input.size(), params, &context, stats);
+}
+
+vector<unsigned char> Deflate::compressWith(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext* context,
+                                            CompressionStats* stats) {
+    vector<unsigned char> output;
+    CacheKey key;
+    if (cache) {
+        key = CacheKey::of(data, size, params);
+        if (cache->lookup(key, output)) {
+            DEFLATE_STAT(if (stats) ++stats->resultCacheHits);
+            return output;
+        }
+        DEFLATE_STAT(if (stats) ++stats->resultCacheMisses);
+    }
+    writeStreamHeader(output, size);
+
+    HardwareCounters counters;
+    DEFLATE_STAT(if (stats && stats->collectHardwareCounters) counters.start());
+
+    // Everything the call allocates goes through the tracker, the returned buffer is the caller's
+    TrackingMemoryResource tracker(memory);
+    Deflate engine(&tracker);
+    CompressionContext callContext(&tracker);
+    CompressionParams fitted = fitMemoryLimit(params);
+    auto write = [&](const vector<unsigned char>& payload, size_t rawSize) {
+        writeBlockHeader(output, rawSize, payload.size());
+        output.insert(output.end(), payload.begin(), payload.end());
+    };
+    if (!params.dedupChunkSize) {
+        engine.compressBlocks(data, size, fitted, context ? *context : callContext, stats, write);
+    } else {
+        // Only the first copy of each chunk is compressed, repeats become reference blocks
+        vector<DedupSegment> segments = Dedup::segments(data, size, params.dedupChunkSize);
+        for (const DedupSegment& segment : segments) {
+            if (!segment.reference) {
+                engine.compressBlocks(data + segment.offset, segment.size, fitted, context ? *context : callContext, stats, write);
+                continue;
+            }
+            DEFLATE_STAT(if (stats) stats->dedupBytes += segment.size);
+            for (uint64_t done = 0; done < segment.size;) {
+                size_t rawSize = static_cast<size_t>(min<uint64_t>(segment.size - done, MAX_BLOCK_SIZE));
+                vector<unsigned char> payload(1, REFERENCE_FLAG);
+                putU64(payload, segment.source + done);
+                write(payload, rawSize);
+                done += rawSize;
+            }
+        }
+    }
+
+    DEFLATE_STAT(if (stats && stats->collectHardwareCounters) counters.stop(*stats));
+    size_t retained = context ? context->retainedBytes() : 0;
+    if (stats) stats->peakMemory = max(stats->peakMemory, static_cast<uint64_t>(tracker.peak() + retained));
+    if (cache) cache->store(key, output);
+    return output;
+}
+
+// Largest piece of a delta gap coded after a dictionary. The rest of the window, three times as much, is its
+// dictionary, which leaves room for the edits before it to have shifted its bytes either way
+static const size_t PRIMED_BLOCK_SIZE = 16 << 10;
+// Shorter copies may be folded into the dictionary pieces, longer ones always become copy blocks that skip the parse
+static const size_t PRIMED_MIN_COPY = 4 << 10;
+
+vector<unsigned char> Deflate::compressDelta(const unsigned char* input, size_t size, const unsigned char* reference, size_t referenceSize,
+                                             const CompressionParams& params, CompressionStats* stats) {
+    vector<unsigned char> output;
+    writeStreamHeader(output, size);
+    TrackingMemoryResource tracker(memory);
+    Deflate engine(&tracker);
+    CompressionContext context(&tracker);
+    CompressionParams fitted = fitMemoryLimit(params);
+    auto write = [&](const vector<unsigned char>& payload, size_t rawSize) {
+        writeBlockHeader(output, rawSize, payload.size());
+        output.insert(output.end(), payload.begin(), payload.end());
+    };
+
+    vector<unsigned char> check(1, DELTA_FLAG);
+    putU64(check, referenceSize);
+    putU64(check, XXH3_64bits(reference, referenceSize));
+    write(check, 0);
+    DeltaIndex index(reference, referenceSize, &tracker);
+    vector<DeltaSegment> segments = index.segments(input, size);
+    const bool primed = referenceSize > 0 && fitted.matchFinder == MatchFinder::HashChain;
+    const size_t pieceSize = min(max(fitted.blockSize, size_t(1)), PRIMED_BLOCK_SIZE);
+    // A piece and its dictionary share one window, whatever window the params ask for
+    CompressionParams primedParams = fitted;
+    primedParams.windowSize = MAX_WINDOW_SIZE;
+    // Every copy the index found, in order, to line the gap pieces up with the reference
+    vector<DeltaSegment> anchors;
+    for (const DeltaSegment& segment : segments) {
+        if (segment.copy) anchors.push_back(segment);
+    }
+
+    // Where the piece at offset lines up in the reference: past the last copy starting before its middle, or before
+    // the first copy, or at the same offset when there are none
+    auto alignedSource = [&](uint64_t offset, size_t length) {
+        uint64_t middle = offset + length / 2;
+        auto next = upper_bound(anchors.begin(), anchors.end(), middle,
+                                [](uint64_t position, const DeltaSegment& anchor) { return position < anchor.offset; });
+        if (next != anchors.begin()) {
+            const DeltaSegment& anchor = *(next - 1);
+            return anchor.source + (offset - anchor.offset);
+        }
+        if (next == anchors.end()) return offset;
+        return next->source - min(next->source, next->offset - offset);
+    };
+
+    // Segments [first, last) as the index found them, copy blocks and the gaps between them compressed as usual
+    auto compressSegments = [&](size_t first, size_t last, CompressionStats* segmentStats,
+                                const function<void(const vector<unsigned char>&, size_t)>& out) {
+        for (size_t s = first; s < last; ++s) {
+            const DeltaSegment& segment = segments[s];
+            if (!segment.copy) {
+                engine.compressBlocks(input + segment.offset, segment.size, fitted, context, segmentStats, out);
+                continue;
+            }
+            DEFLATE_STAT(if (segmentStats) segmentStats->deltaBytes += segment.size);
+            for (uint64_t done = 0; done < segment.size;) {
+                size_t rawSize = static_cast<size_t>(min<uint64_t>(segment.size - done, MAX_BLOCK_SIZE));
+                vector<unsigned char> payload(1, DELTA_FLAG);
+                putU64(payload, segment.source + done);
+                out(payload, rawSize);
+                done += rawSize;
+            }
+        }
+    };
+
+    // The segments are coded both that way and as dictionary pieces, the smaller goes out
+    auto compressRun = [&](size_t first, size_t last) {
+        if (!primed) {
+            compressSegments(first, last, stats, write);
+            return;
+        }
+        vector<pair<vector<unsigned char>, size_t>> plain;
+        size_t plainSize = 0;
+        CompressionStats plainStats;
+        compressSegments(first, last, stats ? &plainStats : nullptr, [&](const vector<unsigned char>& payload, size_t rawSize) {
+            plain.push_back(make_pair(payload, rawSize));
+            plainSize += 8 + payload.size();
+        });
+
+        uint64_t gapOffset = segments[first].offset;
+        uint64_t gapSize = segments[last - 1].offset + segments[last - 1].size - gapOffset;
+        size_t count = (gapSize + pieceSize - 1) / pieceSize;
+        vector<vector<unsigned char>> pieces(count);
+        size_t piecesSize = 0;
+        CompressionStats primedStats;
+        // Each run of pieces gets a context of its own on a worker thread
+        size_t runs = min(count, static_cast<size_t>(max(fitted.threads, 1)));
+        vector<CompressionStats> runStats(stats ? runs : 0);
+        parallelFor(runs, fitted.threads, [&](size_t run) {
+            CompressionContext runContext(&tracker);
+            CompressionContext& pieceContext = runs == 1 ? context : runContext;
+            for (size_t i = run * count / runs; i < (run + 1) * count / runs; ++i) {
+                uint64_t offset = gapOffset + i * pieceSize;
+                size_t length = static_cast<size_t>(min<uint64_t>(pieceSize, gapOffset + gapSize - offset));
+                // The dictionary is centred on the piece's own stretch of the reference, clipped to the reference
+                uint64_t aligned = alignedSource(offset, length);
+                size_t dictionarySize = min(static_cast<size_t>(MAX_WINDOW_SIZE) - length, referenceSize);
+                uint64_t margin = dictionarySize > length ? (dictionarySize - length) / 2 : 0;
+                uint64_t start = min(aligned - min(aligned, margin), uint64_t(referenceSize - dictionarySize));
+                pieces[i] = engine.compressPrimedBlock(input + offset, length, reference, start, dictionarySize, primedParams,
+                                                       pieceContext, stats ? &runStats[run] : nullptr);
+            }
+        });
+        for (const CompressionStats& runStat : runStats) primedStats.merge(runStat);
+        for (const vector<unsigned char>& piece : pieces) piecesSize += 8 + piece.size();
+
+        if (piecesSize < plainSize) {
+            for (size_t i = 0; i < count; ++i) write(pieces[i], static_cast<size_t>(min<uint64_t>(pieceSize, gapSize - i * pieceSize)));
+            if (stats) stats->merge(primedStats);
+        } else {
+            for (const auto& block : plain) write(block.first, block.second);
+            if (stats) stats->merge(plainStats);
+        }
+    };
+
+    // Long copies always go out as copy blocks. With dictionary pieces a short copy costs a match or two inside one,
+    // which can beat a block of its own and the split of the pieces around it, so the runs between long copies are
+    // tried both ways
+    size_t first = 0;
+    for (size_t s = 0; s <= segments.size(); ++s) {
+        bool longCopy = s < segments.size() && segments[s].copy && segments[s].size >= PRIMED_MIN_COPY;
+        if (s < segments.size() && !longCopy) continue;
+        if (s > first) compressRun(first, s);
+        if (longCopy) compressSegments(s, s + 1, stats, write);
+        first = s + 1;
+    }
+    if (stats) stats->peakMemory = max(stats->peakMemory, static_cast<uint64_t>(tracker.peak()));
+    return output;
+}
+
+vector<unsigned char> Deflate::decompressDelta(const unsigned char* compressed, size_t size, const unsigned char* reference,
+                                               size_t referenceSize, int threads, CompressionStats* stats) {
+    vector<unsigned char> output(decompressedSize(compressed, size));
+    ByteSpan span = {reference, referenceSize};
+    decompressInto(compressed, size, output.data(), output.size(), threads, nullptr, stats, &span);
+    return output;
+}
+
+void Deflate::compressStream(istream& in, ostream& out, const CompressionParams& params, CompressionStats* stats) {
+    TrackingMemoryResource tracker(memory);
+    Deflate engine(&tracker);
+    CompressionContext context(&tracker);
+    CompressionParams fitted = fitMemoryLimit(params);
+    size_t blockSize = max(fitted.blockSize, size_t(1));
+
+    // The size is only known at the end, seekable outputs get it written back then
+    vector<unsigned char> header;
+    writeStreamHeader(header, UNKNOWN_SIZE);
+    streampos sizePosition = out.tellp();
+    out.write(reinterpret_cast<const char*>(header.data()), header.size());
+    uint64_t total = 0;
+
+    // One block per thread is read, compressed and written at a time, so memory doesn't depend on the input size
+    TrackedVector<unsigned char> buffer(blockSize * max(fitted.threads, 1), 0, TrackedAllocator<unsigned char>(&tracker));
+    while (in) {
+        in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t size = static_cast<size_t>(in.gcount());
+        if (size == 0) break;
+        total += size;
+        engine.compressBlocks(buffer.data(), size, fitted, context, stats, [&](const vector<unsigned char>& payload, size_t rawSize) {
+            TRACE_SCOPE("file_write");
+            header.clear();
+            writeBlockHeader(header, rawSize, payload.size());
+            out.write(reinterpret_cast<const char*>(header.data()), header.size());
+            out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+        });
+    }
+    if (sizePosition != streampos(-1) && out) {
+        streampos end = out.tellp();
+        header.clear();
+        putU64(header, total);
+        out.seekp(sizePosition + streamoff(5));
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+        out.seekp(end);
+    }
+    if (stats) stats->peakMemory = max(stats->peakMemory, static_cast<uint64_t>(tracker.peak()));
+}
+
+void Deflate::decompressStream(istream& in, const function<void(const unsigned char*, size_t)>& sink, size_t chunkSize,
+                               CompressionStats* stats) {
+    TrackingMemoryResource tracker(memory);
+    Deflate engine(&tracker);
+    DecompressionContext context(&tracker);
+    WindowWriter writer(&tracker, max(chunkSize, size_t(1)), sink);
+    TrackedVector<unsigned char> payload{TrackedAllocator<unsigned char>(&tracker)};
+    vector<unsigned char> tokens;
+    unsigned char header[13];
+    // Streams written one after another, as by dflt -c a b, decode to their concatenation the way gzip members do.
+    // A raw size never reaches the magic read as a uint32, so a block header that starts with it is the next stream
+    bool next = in.read(reinterpret_cast<char*>(header), 4) && equal(MAGIC, MAGIC + 4, header);
+    if (!next) throw std::runtime_error("Not a Deflate stream");
+    while (next) {
+        if (!in.read(reinterpret_cast<char*>(header + 4), 1)) throw std::runtime_error("Truncated stream header");
+        uint8_t version = header[4];
+        if (version < 1 || version > FORMAT_VERSION) throw std::runtime_error("Unsupported Deflate format version");
+        uint64_t expected = UNKNOWN_SIZE;
+        if (version >= 3) {
+            if (!in.read(reinterpret_cast<char*>(header + 5), 8)) throw std::runtime_error("Truncated stream header");
+            expected = getU64(header + 5);
+        }
+        uint64_t start = writer.written();
+        next = false;
+        while (in.read(reinterpret_cast<char*>(header), 4)) {
+            if (equal(MAGIC, MAGIC + 4, header)) {
+                next = true;
+                break;
+            }
+            if (!in.read(reinterpret_cast<char*>(header + 4), 4)) throw std::runtime_error("Truncated block header");
+            uint32_t rawSize = getU32(header);
+            uint32_t payloadSize = getU32(header + 4);
+            // No writer produces more, a coded block falls back to stored at rawSize + 1
+            if (rawSize > MAX_BLOCK_SIZE || payloadSize > MAX_BLOCK_SIZE + 1) throw std::runtime_error("Block larger than Deflate::MAX_BLOCK_SIZE");
+            payload.clear();
+            {
+                TRACE_SCOPE("file_read");
+                // Grown as the bytes arrive, so a header claiming more than the input holds fails before allocating it
+                while (payload.size() < payloadSize) {
+                    size_t done = payload.size();
+                    size_t step = min(payloadSize - done, max(done, STREAM_CHUNK_SIZE));
+                    payload.resize(done + step);
+                    if (!in.read(reinterpret_cast<char*>(payload.data() + done), step)) throw std::runtime_error("Truncated block");
+                }
+            }
+            if (isStored(payload.data(), payloadSize, version)) {
+                writer.raw(payload.data() + 1, payloadSize - 1);
+                writer.endBlock(rawSize);
+                continue;
+            }
+            // The window doesn't reach back to the copies the dedup pre-pass refers to
+            if (isReference(payload.data(), payloadSize, version)) throw std::runtime_error("Deduplicated streams need decompress");
+            if (isDelta(payload.data(), payloadSize, version) || isPrimed(payload.data(), payloadSize, version)) {
+                throw std::runtime_error("Delta streams need decompressDelta");
+            }
+            StageTimer decodeTimer(stats, CompressionStats::HUFFMAN_DECODE, payloadSize);
+            bool repeatOffsets = false;
+            const HuffmanDecodeTable* flatTable =
+                    engine.entropyDecode(payload.data(), payloadSize, context, stats, version, 1, rawSize, tokens, repeatOffsets);
+            MemoryCharge tokensCharge(&tracker, context.encoded.capacity() + tokens.capacity());
+            if (flatTable) {
+                streamHuffman(context.encoded, *flatTable, repeatOffsets, writer);
+            } else {
+                streamTokens(tokens, repeatOffsets, writer);
+            }
+            writer.endBlock(rawSize);
+            decodeTimer.done(rawSize);
+        }
+        if (!next && in.gcount() != 0) throw std::runtime_error("Truncated block header");
+        if (expected != UNKNOWN_SIZE && expected != writer.written() - start) throw std::runtime_error("Stream size mismatch");
+    }
+    writer.finish();
+    if (stats) stats->peakMemory = max(stats->peakMemory, static_cast<uint64_t>(tracker.peak()));
+}
+
+void Deflate::decompressStream(istream& in, ostream& out, CompressionStats* stats) {
+    decompressStream(in, [&](const unsigned char* chunk, size_t size) {
+        TRACE_SCOPE("file_write");
+        out.write(reinterpret_cast<const char*>(chunk), size);
+        if (!out) throw std::runtime_error("Write failed");
+    }, STREAM_CHUNK_SIZE, stats);
+}
+
+vector<unsigned char> Deflate::compress(const vector<unsigned char>& input, int level, CompressionStats* stats) {
+    return compress(input, CompressionParams::fromLevel(level), stats);
+}
+
+vector<unsigned char> Deflate::decompress(const vector<unsigned char>& compressed, int threads, CompressionStats* stats) {
+    return decompressWith(compressed.data(), compressed.size(), threads, nullptr, stats);
+}
+
+vector<unsigned char> Deflate::decompress(const vector<unsigned char>& compressed, DecompressionContext& context, CompressionStats* stats) {
+    return decompressWith(compressed.data(), compressed.size(), 1, &context, stats);
+}
+
+uint64_t Deflate::decompressedSize(const unsigned char* compressed, size_t size) {
+    // The header's size only covers the first of concatenated streams
+    return readStreamBlocks(compressed, size).total;
+}
+
+size_t Deflate::decompress(const unsigned char* compressed, size_t size, unsigned char* output, size_t capacity, int threads,
+                           CompressionStats* stats) {
+    return decompressInto(compressed, size, output, capacity, threads, nullptr, stats);
+}
+
+void Deflate::decompressToFile(const unsigned char* compressed, size_t size, const string& path, int threads, CompressionStats* stats) {
+    uint64_t total = decompressedSize(compressed, size);
+    // mio only maps files that exist, so the file is created at its final size first
+    {
+        ofstream create(path, ios::binary | ios::trunc);
+        if (!create) throw std::runtime_error("Cannot create " + path);
+    }
+    if (total == 0) return;
+    if (truncate(path.c_str(), static_cast<off_t>(total)) != 0) throw std::runtime_error("Cannot resize " + path);
+
+    error_code error;
+    mio::mmap_sink sink;
+    sink.map(path, error);
+    if (error) throw std::runtime_error("Cannot map " + path + ": " + error.message());
+    decompressInto(compressed, size, reinterpret_cast<unsigned char*>(sink.data()), sink.size(), threads, nullptr, stats);
+    sink.sync(error);
+    if (error) throw std::runtime_error("Cannot write " + path + ": " + error.message());
+}
+
+vector<unsigned char> Deflate::decompressWith(const unsigned char* compressed, size_t size, int threads, DecompressionContext* context,
+                                              CompressionStats* stats) {
+    vector<unsigned char> output(decompressedSize(compressed, size));
+    decompressInto(compressed, size, output.data(), output.size(), threads, context, stats);
+    return output;
+}
+
+size_t Deflate::decompressInto(const unsigned char* compressed, size_t size, unsigned char* output, size_t capacity, int threads,
+                               DecompressionContext* context, CompressionStats* stats, const ByteSpan* reference) {
+    // Walk the block headers first so every block knows where its input and output start
+    StreamBlocks blocks = readStreamBlocks(compressed, size);
+    if (blocks.total > capacity) throw std::runtime_error("Output buffer too small");
+    const vector<size_t>& payloadStart = blocks.payloadStart;
+    const vector<size_t>& payloadSizes = blocks.payloadSizes;
+    const vector<size_t>& rawSizes = blocks.rawSizes;
+    const vector<size_t>& outputStart = blocks.outputStart;
+    const vector<size_t>& streamStart = blocks.streamStart;
+    const vector<uint8_t>& versions = blocks.versions;
+
+    // A delta stream names its reference up front, before anything is copied from it. Every concatenated stream's check
+    // is verified, they all have to name the one reference
+    bool delta = false;
+    for (size_t block = 0; block < payloadStart.size(); ++block) {
+        const unsigned char* payload = &compressed[payloadStart[block]];
+        if (isPrimed(payload, payloadSizes[block], versions[block])) {
+            if (!delta) throw std::runtime_error("Delta block before its reference check");
+            continue;
+        }
+        if (!isDelta(payload, payloadSizes[block], versions[block])) continue;
+        if (payloadSizes[block] != 17 || rawSizes[block] != 0) {
+            if (!delta) throw std::runtime_error("Delta block before its reference check");
+            continue;
+        }
+        if (!reference) throw std::runtime_error("Delta stream, decompressDelta needs its reference");
+        if (getU64(payload + 1) != reference->size || getU64(payload + 9) != XXH3_64bits(reference->data, reference->size)) {
+            throw std::runtime_error("Not the reference this delta stream was compressed against");
+        }
+        delta = true;
+    }
+
+    HardwareCounters counters;
+    DEFLATE_STAT(if (stats && stats->collectHardwareCounters) counters.start());
+
+    TrackingMemoryResource tracker(memory);
+    vector<CompressionStats> blockStats(stats ? payloadStart.size() : 0);
+    Deflate engine(&tracker);
+    DecompressionContext callContext(&tracker);
+    DecompressionContext& serialContext = context ? *context : callContext;
+    bool serial = threads <= 1 || payloadStart.size() <= 1;
+    parallelFor(payloadStart.size(), threads, [&](size_t block) {
+        CompressionStats* blockStat = stats ? &blockStats[block] : nullptr;
+        const unsigned char* payload = &compressed[payloadStart[block]];
+        if (isStored(payload, payloadSizes[block], versions[block])) {
+            if (payloadSizes[block] - 1 != rawSizes[block]) throw std::runtime_error("Block size mismatch");
+            memcpy(output + outputStart[block], payload + 1, rawSizes[block]);
+            return;
+        }
+        if (isReference(payload, payloadSizes[block], versions[block])) return;
+        if (isDelta(payload, payloadSizes[block], versions[block])) {
+            if (rawSizes[block] == 0) return;
+            uint64_t source = getU64(payload + 1);
+            if (!delta || payloadSizes[block] != 9 || source > reference->size || reference->size - source < rawSizes[block]) {
+                throw std::runtime_error("Invalid delta block");
+            }
+            memcpy(output + outputStart[block], reference->data + source, rawSizes[block]);
+            return;
+        }
+        // A dictionary block is its coded block decoded after the stretch of the reference it names
+        size_t payloadSize = payloadSizes[block];
+        ByteSpan dictionary = {nullptr, 0};
+        if (isPrimed(payload, payloadSize, versions[block])) {
+            uint64_t start = getU64(payload + 1);
+            dictionary.size = getU32(payload + 9);
+            if (!delta || start > reference->size || reference->size - start < dictionary.size) {
+                throw std::runtime_error("Invalid dictionary block");
+            }
+            dictionary.data = reference->data + start;
+            payload += 13;
+            payloadSize -= 13;
+        }
+        const ByteSpan* history = dictionary.data ? &dictionary : nullptr;
+        vector<unsigned char> decoded;
+        if (serial) {
+            // A lone block gets the threads, for its sync index
+            decoded = engine.decompressBlock(payload, payloadSize, serialContext, blockStat, versions[block],
+                                             payloadStart.size() == 1 ? threads : 1, rawSizes[block], history);
+        } else {
+            DecompressionContext taskContext(&tracker);
+            decoded = engine.decompressBlock(payload, payloadSize, taskContext, blockStat, versions[block], 1, rawSizes[block], history);
+        }
+        // The older match finders pad a match that runs to the end of the block with a '\0' next character
+        if (decoded.size() < rawSizes[block] || decoded.size() > rawSizes[block] + 1) {
+            throw std::runtime_error("Block size mismatch");
+        }
+        MemoryCharge decodedCharge(&tracker, decoded.capacity());
+        copy(decoded.begin(), decoded.begin() + rawSizes[block], output + outputStart[block]);
+    });
+    for (const CompressionStats& s : blockStats) stats->merge(s);
+    // References copy from earlier output of their own stream, which may itself be a reference, so they go last and in order
+    for (size_t block = 0; block < payloadStart.size(); ++block) {
+        const unsigned char* payload = &compressed[payloadStart[block]];
+        if (!isReference(payload, payloadSizes[block], versions[block])) continue;
+        uint64_t source = getU64(payload + 1);
+        size_t streamOffset = outputStart[block] - streamStart[block];
+        if (source > streamOffset || streamOffset - source < rawSizes[block]) throw std::runtime_error("Invalid reference block");
+        memcpy(output + outputStart[block], output + streamStart[block] + source, rawSizes[block]);
+    }
+    DEFLATE_STAT(if (stats && stats->collectHardwareCounters) counters.stop(*stats));
+    size_t retained = context ? context->retainedBytes() : 0;
+    if (stats) stats->peakMemory = max(stats->peakMemory, static_cast<uint64_t>(tracker.peak() + retained));
+    return blocks.total;
+}
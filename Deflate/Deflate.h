@@ -0,0 +1,299 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "LZ77/LZ77.h"
+#include "Huffman/Huffman.h"
+#include "FSE/FSE.h"
+#include "Stats.h"
+#include "Memory/Memory.h"
+
+using namespace std;
+
+// Values 0-3 line up with the old lz_cv argument of compress()
+enum class MatchFinder {
+    BruteForce = 0,
+    SuffixArray = 1,
+    Deque = 2,
+    RabinKarp = 3,
+    HashChain = 4
+};
+
+enum class Parser {
+    Greedy,
+    Lazy
+};
+
+// Entropy coder of each block's token stream, Auto takes whichever the size estimates say is smaller
+enum class EntropyCoder {
+    Huffman,
+    FSE,
+    Auto
+};
+
+struct CompressionParams {
+    static const int MIN_LEVEL = 1;
+    static const int DEFAULT_LEVEL = 6;
+    static const int MAX_LEVEL = 9;
+    static const int ULTRA_LEVEL = 10;
+
+    MatchFinder matchFinder = MatchFinder::HashChain;
+    int windowSize = 32768;   // Offsets are stored in 16 bits, larger windows are cut to Deflate::MAX_WINDOW_SIZE
+    int chainDepth = 128;     // Candidates walked per position by the hash chain finder
+    int niceLength = 258;     // Stop searching once a match is at least this long
+    int minMatch = 3;         // Shortest match the hash chain finder looks for, 3, 4 or 6
+    int hashBits = 15;        // Hash chain head table has 1 << hashBits entries, 12, 15 or 16
+    int skipTrigger = 6;      // Hash chain finder steps a byte further every 1 << skipTrigger positions without a match, 0 for never
+    Parser parser = Parser::Lazy;
+    EntropyCoder entropyCoder = EntropyCoder::Auto;
+    size_t blockSize = 1 << 20; // Input is split into independently coded blocks of this size, at most Deflate::MAX_BLOCK_SIZE
+    int threads = 1;            // Blocks are compressed on this many threads
+    size_t memoryLimit = 0;     // Working memory budget in bytes, 0 for none, see Deflate::fitMemoryLimit
+    size_t syncInterval = 0;    // Huffman coded blocks get a sync point every this many symbols, 0 for none, see SYNC_INDEX_FLAG
+    size_t dedupChunkSize = 0;  // Average chunk size of the dedup pre-pass of compress, 0 for none, see Dedup and REFERENCE_FLAG
+
+    // Levels 1-9 trade speed for ratio, ULTRA_LEVEL searches the whole window with no early exit
+    static CompressionParams fromLevel(int level);
+
+    // Samples the input and returns the fastest level whose sample ratio (input/output) reaches targetRatio,
+    // or the best ratio found when none does
+    static CompressionParams automatic(const vector<unsigned char>& input, double targetRatio);
+};
+
+class CompressionCache;
+
+// A caller's buffer, for the batch calls
+struct ByteSpan {
+    const unsigned char* data;
+    size_t size;
+};
+
+// What compressBlock keeps between calls: the hash chain tables and the sequence buffer, plus the coders
+// Passing one to Deflate::compress reuses them, so small inputs skip most of the per-call setup
+// A context serves one call at a time, forThread() keeps one per thread
+class CompressionContext {
+public:
+    explicit CompressionContext(MemoryResource* memory = defaultMemoryResource());
+
+    // Frees everything retained, the next call starts from scratch
+    void reset();
+    // Bytes held between calls
+    size_t retainedBytes() const;
+
+    static CompressionContext& forThread();
+
+private:
+    friend class Deflate;
+    MemoryResource* memory;
+    LZ77 lz;
+    Huffman huff;
+    FSE fse;
+    LZ77Sequences sequences;
+    // A batch's shared table, offered to each block next to the selectable static tables while compressBatch runs
+    shared_ptr<const StaticHuffmanTable> sharedTable;
+};
+
+// The decoding side: sequence and payload buffers, and the last dynamic Huffman and tANS decode tables,
+// which a block with the same code table header uses instead of building them again
+class DecompressionContext {
+public:
+    explicit DecompressionContext(MemoryResource* memory = defaultMemoryResource());
+
+    void reset();
+    size_t retainedBytes() const;
+
+    static DecompressionContext& forThread();
+
+private:
+    friend class Deflate;
+    MemoryResource* memory;
+    LZ77 lz;
+    Huffman huff;
+    FSE fse;
+    LZ77Sequences sequences;
+    vector<unsigned char> encoded;
+    vector<unsigned char> huffmanHeader;
+    HuffmanDecodeTable huffmanTable;
+    vector<unsigned char> fseHeader;
+    FSEDecodeTable fseTable;
+};
+
+// Block based DEFLATE style engine: LZ77 tokens per block, then a static or dynamic Huffman code or a tANS code per block
+// Layout: "DFLT" magic, version byte, uint64 uncompressed size (UNKNOWN_SIZE when it wasn't known up front), then blocks of
+//   uint32 raw size | uint32 payload size | block flags | table id (0 = dynamic) | [uint16 count, (byte, length) pairs] | [sync index] | Huffman data
+// or, for tANS,
+//   uint32 raw size | uint32 payload size | block flags | FSE_TABLE_ID | table log | uint16 count | (byte, uint16 count) pairs | uint32 symbols | FSE data
+// or, stored,
+//   uint32 raw size | uint32 payload size | STORED_FLAG | raw bytes
+// or, for a duplicate of earlier output,
+//   uint32 raw size | uint32 payload size | REFERENCE_FLAG | uint64 source offset
+// or, for a copy from the reference of a delta stream,
+//   uint32 raw size | uint32 payload size | DELTA_FLAG | uint64 reference offset [| uint64 reference hash, raw size 0]
+// or, for bytes of a delta stream coded with a stretch of the reference as their history,
+//   uint32 raw size | uint32 payload size | DICTIONARY_FLAG | uint64 reference offset | uint32 size | block flags | table id | ...
+// Version 1 streams have no block flags byte, version 1 and 2 streams have no uncompressed size
+class Deflate {
+public:
+    // Version 2 added the block flags and version 3 the uncompressed size, older streams are still read
+    static const uint8_t FORMAT_VERSION = 3;
+    static const uint64_t UNKNOWN_SIZE = UINT64_MAX;
+    // Block flag: match offsets are stored as rep codes, see RepeatOffsets
+    static const unsigned char REPEAT_OFFSETS_FLAG = 1;
+    // Block flag: the Huffman data is preceded by uint32 symbols | uint32 interval | uint32 count | count uint32 bit offsets,
+    // the offset of symbol interval * (k + 1), so the runs between them can be decoded on separate threads
+    static const unsigned char SYNC_INDEX_FLAG = 2;
+    // Block flag: the rest of the payload is the block as it is, for data that doesn't compress. No other flag goes with it
+    static const unsigned char STORED_FLAG = 4;
+    // Block flag: the block is a copy of earlier output, the payload is the flags byte and the uint64 output offset of
+    // the copy. Written by the dedup pre-pass, so only the decoders that keep the whole output read it
+    static const unsigned char REFERENCE_FLAG = 8;
+    // Block flag: the block is a copy from the reference of compressDelta, the payload is the flags byte and the uint64
+    // reference offset of the copy. A delta stream starts with an empty one whose payload adds the uint64 size and
+    // XXH3-64 hash of the reference
+    static const unsigned char DELTA_FLAG = 16;
+    // Block flag: the rest of a delta stream block is the uint64 reference offset and uint32 size of a dictionary, then a
+    // coded block whose matches may reach back into that stretch of the reference, as if it came right before the block
+    static const unsigned char DICTIONARY_FLAG = 32;
+    // Leaves room for real offsets stored + RepeatOffsets::COUNT in 16 bits
+    static const int MAX_WINDOW_SIZE = UINT16_MAX - RepeatOffsets::COUNT;
+    static const unsigned char FSE_TABLE_ID = Huffman::RESERVED_TABLE_ID;
+    static const size_t MIN_BLOCK_SIZE = 16 << 10;
+    // The LZ77 parsers index a block with int and its header stores 32 bit sizes, fitMemoryLimit caps blockSize here.
+    // It stays below the "DFLT" magic read as a raw size, so a block header starting with the magic is a concatenated stream
+    static const size_t MAX_BLOCK_SIZE = 1 << 30;
+
+    // Internal buffers are allocated from, or charged to, memory
+    explicit Deflate(MemoryResource* memory = defaultMemoryResource());
+    // compress() looks its output up in, and adds it to, cache (see Cache.h), null for none. The cache isn't owned
+    void setCache(CompressionCache* cache) { this->cache = cache; }
+
+    // stats, when given, is filled in if the build has DEFLATE_STATS
+    vector<unsigned char> compress(const vector<unsigned char>& input, const CompressionParams& params, CompressionStats* stats = nullptr);
+    vector<unsigned char> compress(const vector<unsigned char>& input, int level, CompressionStats* stats = nullptr);
+    vector<unsigned char> decompress(const vector<unsigned char>& compressed, int threads = 1, CompressionStats* stats = nullptr);
+
+    // Uncompressed size of a stream, from its block headers. Streams written one after another (cat a.dflt b.dflt)
+    // decode to their concatenation, as gzip members do, here and in every decompress call
+    static uint64_t decompressedSize(const unsigned char* compressed, size_t size);
+    // Decode into output, which has to hold decompressedSize() bytes, and return the size
+    size_t decompress(const unsigned char* compressed, size_t size, unsigned char* output, size_t capacity, int threads = 1,
+                      CompressionStats* stats = nullptr);
+    // Decode into a file created at its final size and memory mapped, so the output is never held in a vector
+    void decompressToFile(const unsigned char* compressed, size_t size, const string& path, int threads = 1, CompressionStats* stats = nullptr);
+
+    // Same, with the single threaded work going through a reusable context. Blocks on other threads (params.threads > 1)
+    // get their own. peakMemory counts what the context retains after the call
+    vector<unsigned char> compress(const vector<unsigned char>& input, const CompressionParams& params, CompressionContext& context,
+                                   CompressionStats* stats = nullptr);
+    vector<unsigned char> decompress(const vector<unsigned char>& compressed, DecompressionContext& context, CompressionStats* stats = nullptr);
+
+    // Output i is inputs[i] compressed on its own, as compress(inputs[i], params) would, with the inputs spread over
+    // params.threads threads and a context reused per run of inputs
+    // With a sharedTableId (2..0xFE), the batch's LZ77 token histogram is turned into one Huffman table, registered
+    // under that id when it beats per-input tables (or storing) overall. Each input's block is then offered it next to
+    // the static tables, through the context, and codes with whichever is smaller, so small inputs skip the table
+    // header. Another process has to register table->codes under the
+    // same id before decompressing. The id has to be free: the batch throws rather than replace a table earlier
+    // outputs need, and Huffman::unregisterTable frees an id once its outputs are no longer read. Batch tables
+    // aren't offered to selectStaticTable, so compress() output never depends on an earlier batch
+    struct BatchResult {
+        vector<vector<unsigned char>> outputs;
+        shared_ptr<const StaticHuffmanTable> table; // Null when no shared table was registered
+    };
+    BatchResult compressBatch(const vector<ByteSpan>& inputs, const CompressionParams& params, unsigned char sharedTableId = 0,
+                              CompressionStats* stats = nullptr);
+    vector<vector<unsigned char>> decompressBatch(const vector<ByteSpan>& inputs, int threads = 1, CompressionStats* stats = nullptr);
+
+    // Delta compression against a reference, such as the previous version of the same file. Long matches into the
+    // reference, found with a DeltaIndex, become copy blocks. The bytes between them, short copies included, are coded
+    // in pieces, each parsed after the stretch of the reference it lines up with (DICTIONARY_FLAG), so the matches
+    // around small edits reach into the reference too. Where that comes out larger, the short copies and the gaps
+    // between them go out as copy blocks and compressed blocks instead.
+    // The hash chain finder is the only one that parses after a dictionary, the others always compress as usual.
+    // decompressDelta needs the same reference, it checks its size and hash
+    vector<unsigned char> compressDelta(const unsigned char* input, size_t size, const unsigned char* reference, size_t referenceSize,
+                                        const CompressionParams& params, CompressionStats* stats = nullptr);
+    vector<unsigned char> decompressDelta(const unsigned char* compressed, size_t size, const unsigned char* reference, size_t referenceSize,
+                                          int threads = 1, CompressionStats* stats = nullptr);
+
+    // Reads, compresses and writes one block per thread at a time, so memory stays flat for any input size
+    void compressStream(istream& in, ostream& out, const CompressionParams& params, CompressionStats* stats = nullptr);
+    // Reads and decodes one block at a time, passing the output to sink in chunks of chunkSize bytes (the last one
+    // shorter). Only the current compressed block and a window of history are held, not the output, so pipes and
+    // sockets decompress in constant memory
+    static const size_t STREAM_CHUNK_SIZE = 64 << 10;
+    void decompressStream(istream& in, const function<void(const unsigned char*, size_t)>& sink, size_t chunkSize = STREAM_CHUNK_SIZE,
+                          CompressionStats* stats = nullptr);
+    void decompressStream(istream& in, ostream& out, CompressionStats* stats = nullptr);
+
+    // Worst case working memory of compress/compressStream, excluding the caller's input and output
+    static size_t estimateWorkingMemory(const CompressionParams& params);
+    // Caps blockSize at MAX_BLOCK_SIZE, then drops threads, then block size, then window until the estimate fits
+    // params.memoryLimit (or nothing is left to drop)
+    static CompressionParams fitMemoryLimit(CompressionParams params);
+
+    vector<unsigned char> compressBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionStats* stats = nullptr);
+    vector<unsigned char> decompressBlock(const unsigned char* payload, size_t size, CompressionStats* stats = nullptr, uint8_t version = FORMAT_VERSION);
+    vector<unsigned char> compressBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                                        CompressionStats* stats = nullptr);
+    vector<unsigned char> decompressBlock(const unsigned char* payload, size_t size, DecompressionContext& context,
+                                          CompressionStats* stats = nullptr, uint8_t version = FORMAT_VERSION, int threads = 1,
+                                          size_t rawSize = 0, const ByteSpan* history = nullptr);
+
+    // Runs the configured match finder over a block into context.sequences. data[0, historySize) is a preset dictionary
+    // the block's matches may reach into and isn't coded, only the hash chain finder takes one
+    void lz77Parse(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                   size_t historySize = 0);
+
+private:
+    // Compresses consecutive blocks and passes each payload, in order, to write(payload, raw size)
+    // Blocks on the calling thread use context, each block on a worker thread gets a new one
+    void compressBlocks(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context,
+                        CompressionStats* stats, const function<void(const vector<unsigned char>&, size_t)>& write);
+    vector<unsigned char> compressWith(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext* context,
+                                       CompressionStats* stats);
+    vector<unsigned char> decompressWith(const unsigned char* compressed, size_t size, int threads, DecompressionContext* context,
+                                         CompressionStats* stats);
+    // reference is the one a delta stream was compressed against, null for any other stream
+    size_t decompressInto(const unsigned char* compressed, size_t size, unsigned char* output, size_t capacity, int threads,
+                          DecompressionContext* context, CompressionStats* stats, const ByteSpan* reference = nullptr);
+    // compressBlock in two halves, the LZ77 parse into context.sequences and the entropy coding of them
+    void parseBlock(const unsigned char* data, size_t size, const CompressionParams& params, CompressionContext& context, CompressionStats* stats,
+                    size_t historySize = 0);
+    vector<unsigned char> encodeBlock(const CompressionParams& params, CompressionContext& context, CompressionStats* stats);
+    // Stored payload of a block, see STORED_FLAG
+    vector<unsigned char> storeBlock(const unsigned char* data, size_t size, CompressionStats* stats);
+    // Payload of data coded after the dictionary reference[start, start + dictionarySize), see DICTIONARY_FLAG, or stored
+    // when that doesn't come out smaller
+    vector<unsigned char> compressPrimedBlock(const unsigned char* data, size_t size, const unsigned char* reference, uint64_t start,
+                                              size_t dictionarySize, const CompressionParams& params, CompressionContext& context,
+                                              CompressionStats* stats);
+
+    // The table and entropy stage of decompressBlock. Returns the decode table when context.encoded holds Huffman data
+    // that is still to be read, token by token, otherwise the token stream is left in tokens. rawSize, 0 when unknown,
+    // bounds the token count a tANS block may claim
+    const HuffmanDecodeTable* entropyDecode(const unsigned char* payload, size_t size, DecompressionContext& context, CompressionStats* stats,
+                                            uint8_t version, int threads, size_t rawSize, vector<unsigned char>& tokens, bool& repeatOffsets);
+
+    // Huffman codes for the summed token histogram of a batch, limited to what a static table can hold
+    static unordered_map<unsigned char, string> batchCodes(const vector<uint32_t>& counts);
+
+    // Huffman data straight to LZ77 output: each token's five symbols are read and its match copied in one loop,
+    // with no token bytes or sequences in between. rawSize, when known, sizes the output up front and caps it
+    static vector<unsigned char> inflateHuffman(const vector<unsigned char>& encoded, const HuffmanDecodeTable& table, bool repeatOffsets,
+                                                size_t rawSize, const ByteSpan* history = nullptr);
+
+    // Huffman data of a block with a sync index, each run between sync points decoded as its own task
+    static vector<unsigned char> decodeSynced(const vector<unsigned char>& encoded, const HuffmanDecodeTable& table, size_t symbols,
+                                              size_t interval, const vector<uint32_t>& syncPoints, int threads);
+
+    // Runs task(0..count-1) on up to `threads` threads, each task index is handed out exactly once
+    static void parallelFor(size_t count, int threads, const function<void(size_t)>& task);
+
+    MemoryResource* memory;
+    CompressionCache* cache = nullptr;
+};
@@ -0,0 +1,144 @@
+#include "Stats.h"
+#include <cstring>
+#include <algorithm>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+const int CompressionStats::HISTOGRAM_BUCKETS;
+
+static int histogramBucket(uint32_t value) {
+    int bucket = 0;
+    while (value && bucket < CompressionStats::HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+const char* CompressionStats::stageName(Stage stage) {
+    static const char* NAMES[STAGE_COUNT] = {"lz77_parse", "histogram", "tree_build", "huffman_encode", "huffman_decode", "lz77_expand"};
+    return NAMES[stage];
+}
+
+void CompressionStats::addToken(uint16_t offset, uint16_t length) {
+    ++tokens;
+    if (length == 0) {
+        ++literalTokens;
+        return;
+    }
+    ++matches;
+    ++matchLengthHistogram[histogramBucket(length)];
+    ++offsetHistogram[histogramBucket(offset)];
+}
+
+void CompressionStats::merge(const CompressionStats& other) {
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        stages[i].nanoseconds += other.stages[i].nanoseconds;
+        stages[i].bytesIn += other.stages[i].bytesIn;
+        stages[i].bytesOut += other.stages[i].bytesOut;
+    }
+    tokens += other.tokens;
+    literalTokens += other.literalTokens;
+    matches += other.matches;
+    repeatMatches += other.repeatMatches;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        matchLengthHistogram[i] += other.matchLengthHistogram[i];
+        offsetHistogram[i] += other.offsetHistogram[i];
+    }
+    positionsSearched += other.positionsSearched;
+    candidatesWalked += other.candidatesWalked;
+    huffmanTablesBuilt += other.huffmanTablesBuilt;
+    staticTablesUsed += other.staticTablesUsed;
+    fseTablesBuilt += other.fseTablesBuilt;
+    storedBlocks += other.storedBlocks;
+    dedupBytes += other.dedupBytes;
+    deltaBytes += other.deltaBytes;
+    resultCacheHits += other.resultCacheHits;
+    resultCacheMisses += other.resultCacheMisses;
+    codedSymbols += other.codedSymbols;
+    codedBits += other.codedBits;
+    peakMemory = max(peakMemory, other.peakMemory);
+}
+
+void CompressionStats::print(ostream& out) const {
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const StageStats& s = stages[i];
+        if (s.nanoseconds == 0 && s.bytesIn == 0) continue;
+        out << stageName(static_cast<Stage>(i)) << ": " << s.nanoseconds / 1e6 << " ms, " << s.bytesIn << " -> " << s.bytesOut << " bytes" << endl;
+    }
+    out << "tokens: " << tokens << " (" << matches << " matches, " << repeatMatches << " at a repeat offset, " << literalTokens << " literal only)" << endl;
+    out << "match length / offset histogram (log2 buckets):" << endl;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (matchLengthHistogram[i] == 0 && offsetHistogram[i] == 0) continue;
+        out << "  <" << (1u << i) << ": " << matchLengthHistogram[i] << " / " << offsetHistogram[i] << endl;
+    }
+    out << "average chain walk: " << averageChainWalk() << " candidates over " << positionsSearched << " positions" << endl;
+    out << "huffman tables built: " << huffmanTablesBuilt << ", static tables used: " << staticTablesUsed
+        << ", tANS tables built: " << fseTablesBuilt << ", stored blocks: " << storedBlocks << ", average code length: " << averageCodeLength() << " bits" << endl;
+    if (dedupBytes) out << "deduplicated: " << dedupBytes << " bytes" << endl;
+    if (deltaBytes) out << "copied from the delta reference: " << deltaBytes << " bytes" << endl;
+    if (resultCacheHits || resultCacheMisses) out << "result cache: " << resultCacheHits << " hits, " << resultCacheMisses << " misses" << endl;
+    out << "peak working memory: " << peakMemory << " bytes" << endl;
+    if (hardwareCountersValid) {
+        out << "cycles: " << cycles << ", cache misses: " << cacheMisses << ", branch misses: " << branchMisses << endl;
+    }
+}
+
+HardwareCounters::HardwareCounters() {
+    fds[0] = fds[1] = fds[2] = -1;
+}
+
+HardwareCounters::~HardwareCounters() {
+#ifdef __linux__
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+#endif
+}
+
+bool HardwareCounters::start() {
+#ifdef __linux__
+    const uint64_t CONFIGS[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < 3; ++i) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = CONFIGS[i];
+        attr.disabled = 1;
+        attr.inherit = 1; // Include the block worker threads
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fds[i] < 0) return false; // Commonly blocked by perf_event_paranoid or in containers
+    }
+    for (int fd : fds) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void HardwareCounters::stop(CompressionStats& stats) {
+#ifdef __linux__
+    uint64_t values[3] = {0, 0, 0};
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] < 0) return;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) return;
+    }
+    stats.cycles += values[0];
+    stats.cacheMisses += values[1];
+    stats.branchMisses += values[2];
+    stats.hardwareCountersValid = true;
+#else
+    (void)stats;
+#endif
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include "LZ77/LZ77.h"
+
+using namespace std;
+
+// Filled in by Deflate::compress/decompress when built with DEFLATE_STATS, otherwise left zeroed
+// Stage times are summed over blocks, so with several threads they add up to more than the wall time
+struct CompressionStats {
+    enum Stage {
+        LZ77_PARSE,      // input -> LZ77 byte stream
+        HISTOGRAM,       // countBytes over the byte stream
+        TREE_BUILD,      // Huffman tree and canonical codes, or tANS normalized counts
+        HUFFMAN_ENCODE,  // Either entropy coder, the names predate tANS
+        HUFFMAN_DECODE,
+        LZ77_EXPAND,     // byte stream -> tokens -> output
+        STAGE_COUNT
+    };
+    static const char* stageName(Stage stage);
+
+    struct StageStats {
+        uint64_t nanoseconds = 0;
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+    };
+    StageStats stages[STAGE_COUNT];
+
+    // Every token carries one literal (its next byte), literalTokens counts the ones without a match
+    uint64_t tokens = 0;
+    uint64_t literalTokens = 0;
+    uint64_t matches = 0;
+    uint64_t repeatMatches = 0; // Matches coded as a rep code
+    // Bucket i holds values in [2^(i-1), 2^i), bucket 0 holds zero
+    static const int HISTOGRAM_BUCKETS = 17;
+    uint64_t matchLengthHistogram[HISTOGRAM_BUCKETS] = {0};
+    uint64_t offsetHistogram[HISTOGRAM_BUCKETS] = {0};
+
+    // Hash chain finder only
+    uint64_t positionsSearched = 0;
+    uint64_t candidatesWalked = 0;
+
+    uint64_t huffmanTablesBuilt = 0;
+    uint64_t staticTablesUsed = 0;
+    uint64_t fseTablesBuilt = 0;
+    uint64_t storedBlocks = 0;
+    uint64_t dedupBytes = 0; // Input replaced by references to an earlier copy
+    uint64_t deltaBytes = 0; // Input replaced by copies from the reference of compressDelta
+    uint64_t resultCacheHits = 0; // compress() calls answered by the CompressionCache
+    uint64_t resultCacheMisses = 0;
+    uint64_t codedSymbols = 0;
+    uint64_t codedBits = 0;
+
+    // Peak bytes of the call's working buffers, always filled in
+    uint64_t peakMemory = 0;
+
+    // Set before the call to request perf_event_open counters, Linux only
+    bool collectHardwareCounters = false;
+    bool hardwareCountersValid = false;
+    uint64_t cycles = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+
+    double averageChainWalk() const { return positionsSearched ? double(candidatesWalked) / positionsSearched : 0; }
+    double averageCodeLength() const { return codedSymbols ? double(codedBits) / codedSymbols : 0; }
+
+    void addToken(uint16_t offset, uint16_t length);
+    void merge(const CompressionStats& other);
+    void print(ostream& out) const;
+};
+
+// Times one stage into a CompressionStats, compiles to nothing without DEFLATE_STATS
+class StageTimer {
+public:
+#ifdef DEFLATE_STATS
+    StageTimer(CompressionStats* stats, CompressionStats::Stage stage, uint64_t bytesIn)
+            : stats(stats), stage(stage), bytesIn(bytesIn), start(chrono::steady_clock::now()) {}
+    ~StageTimer() { done(0); }
+    void done(uint64_t bytesOut) {
+        if (!stats) return;
+        CompressionStats::StageStats& s = stats->stages[stage];
+        s.nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        s.bytesIn += bytesIn;
+        s.bytesOut += bytesOut;
+        stats = nullptr;
+    }
+private:
+    CompressionStats* stats;
+    CompressionStats::Stage stage;
+    uint64_t bytesIn;
+    chrono::steady_clock::time_point start;
+#else
+    StageTimer(CompressionStats*, CompressionStats::Stage, uint64_t) {}
+    void done(uint64_t) {}
+#endif
+};
+
+// cycles, cache misses and branch misses of the calling thread and any threads it starts while running
+class HardwareCounters {
+public:
+    HardwareCounters();
+    ~HardwareCounters();
+    bool start();
+    void stop(CompressionStats& stats);
+private:
+    int fds[3];
+};
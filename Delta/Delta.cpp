@@ -0,0 +1,88 @@
+#include "Delta.h"
+#include "Trace/Trace.h"
+#include "Kernels/Kernels.h"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+const size_t DeltaIndex::WINDOW;
+const size_t DeltaIndex::MIN_COPY;
+
+// Polynomial rolling hash of WINDOW bytes, a byte leaves by subtracting it times BASE^WINDOW
+static const uint64_t BASE = 0x100000001B3ull;
+
+static uint64_t windowHash(const unsigned char* p) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < DeltaIndex::WINDOW; ++i) hash = hash * BASE + p[i];
+    return hash;
+}
+
+static inline size_t slot(uint64_t hash, int bits) {
+    return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+DeltaIndex::DeltaIndex(const unsigned char* reference, size_t size, MemoryResource* memory)
+        : reference(reference), referenceSize(size), tableBits(10), table(TrackedAllocator<uint32_t>(memory)) {
+    TRACE_SCOPE("delta_index");
+    size_t windows = size / WINDOW;
+    if (windows >= UINT32_MAX) throw std::runtime_error("Reference too large for the delta index");
+    while (tableBits < 30 && (size_t(1) << tableBits) < windows) ++tableBits;
+    table.assign(size_t(1) << tableBits, 0);
+    for (size_t w = 0; w < windows; ++w) {
+        table[slot(windowHash(reference + w * WINDOW), tableBits)] = static_cast<uint32_t>(w + 1);
+    }
+}
+
+vector<DeltaSegment> DeltaIndex::segments(const unsigned char* input, size_t size) const {
+    TRACE_SCOPE("delta_match");
+    vector<DeltaSegment> result;
+    auto pushLiterals = [&](size_t start, size_t end) {
+        if (end > start) {
+            DeltaSegment segment = {start, end - start, false, 0};
+            result.push_back(segment);
+        }
+    };
+    if (size < WINDOW || referenceSize < WINDOW) {
+        pushLiterals(0, size);
+        return result;
+    }
+
+    uint64_t power = 1;
+    for (size_t i = 0; i < WINDOW; ++i) power *= BASE;
+    size_t (*matchLength)(const unsigned char*, const unsigned char*, size_t) = Kernels::active().matchLength;
+    size_t literalStart = 0, pos = 0;
+    uint64_t hash = windowHash(input);
+    while (true) {
+        uint32_t entry = table[slot(hash, tableBits)];
+        if (entry) {
+            size_t source = size_t(entry - 1) * WINDOW;
+            if (memcmp(reference + source, input + pos, WINDOW) == 0) {
+                // The hit can start before the window, back into the pending literals
+                size_t back = 0;
+                while (back < pos - literalStart && back < source && input[pos - back - 1] == reference[source - back - 1]) ++back;
+                size_t length = back + WINDOW +
+                                matchLength(reference + source + WINDOW, input + pos + WINDOW, min(referenceSize - source, size - pos) - WINDOW);
+                if (length >= MIN_COPY) {
+                    size_t start = pos - back;
+                    pushLiterals(literalStart, start);
+                    DeltaSegment* last = result.empty() ? nullptr : &result.back();
+                    if (last && last->copy && last->offset + last->size == start && last->source + last->size == source - back) {
+                        last->size += length;
+                    } else {
+                        DeltaSegment segment = {start, length, true, source - back};
+                        result.push_back(segment);
+                    }
+                    pos = literalStart = start + length;
+                    if (size - pos < WINDOW) break;
+                    hash = windowHash(input + pos);
+                    continue;
+                }
+            }
+        }
+        if (pos + WINDOW >= size) break;
+        hash = hash * BASE + input[pos + WINDOW] - input[pos] * power;
+        ++pos;
+    }
+    pushLiterals(literalStart, size);
+    return result;
+}
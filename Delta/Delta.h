@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Memory/Memory.h"
+
+using namespace std;
+
+// Long matches between a new version of a file and a reference (yesterday's version), far beyond any LZ77 window.
+// The reference is indexed with a rolling hash of every WINDOW bytes at WINDOW byte steps, so any match of
+// 2 * WINDOW - 1 bytes or more covers an indexed window. The new file is hashed at every position and each hit is
+// checked and extended both ways.
+
+// A run of the new file, either bytes to compress or a copy of size bytes from source in the reference
+struct DeltaSegment {
+    uint64_t offset;
+    uint64_t size;
+    bool copy;
+    uint64_t source;
+};
+
+class DeltaIndex {
+public:
+    static const size_t WINDOW = 32;
+    // A copy costs a 17 byte block. Shorter matches are left to the LZ77 parse of the gap, which has the reference around it as its dictionary
+    static const size_t MIN_COPY = 2 * WINDOW;
+
+    // reference has to outlive the index. The table is allocated from memory
+    DeltaIndex(const unsigned char* reference, size_t size, MemoryResource* memory = defaultMemoryResource());
+
+    // input as copies from the reference and the runs between them, in order and covering all of it
+    vector<DeltaSegment> segments(const unsigned char* input, size_t size) const;
+
+    size_t table_bytes() const { return table.capacity() * sizeof(uint32_t); }
+
+private:
+    const unsigned char* reference;
+    size_t referenceSize;
+    int tableBits;
+    // Window number + 1 of the last reference window with each hash, 0 for none
+    TrackedVector<uint32_t> table;
+};
@@ -0,0 +1,276 @@
+#include "FSE.h"
+#include "Trace/Trace.h"
+#include "Kernels/Kernels.h"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+const int FSE::MIN_TABLE_LOG;
+const int FSE::DEFAULT_TABLE_LOG;
+const int FSE::MAX_TABLE_LOG;
+const int FSE::STATES;
+
+static int highBit(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+int FSE::optimalTableLog(size_t total, int symbolCount) {
+    int tableLog = DEFAULT_TABLE_LOG;
+    // No point in more states than a few per input symbol
+    if (total > 1) tableLog = min(tableLog, highBit(static_cast<uint32_t>(min(total - 1, size_t(UINT32_MAX)))) - 1);
+    if (symbolCount > 1) tableLog = max(tableLog, highBit(static_cast<uint32_t>(symbolCount - 1)) + 2);
+    return max(MIN_TABLE_LOG, min(tableLog, MAX_TABLE_LOG));
+}
+
+vector<uint16_t> FSE::normalizeCounts(const uint32_t counts[256], int tableLog) {
+    const uint32_t tableSize = 1u << tableLog;
+    uint64_t total = 0;
+    int symbolCount = 0;
+    for (int s = 0; s < 256; ++s) {
+        total += counts[s];
+        if (counts[s]) ++symbolCount;
+    }
+    if (total == 0 || uint32_t(symbolCount) > tableSize) {
+        throw std::runtime_error("Cannot normalize counts for this table size");
+    }
+
+    vector<uint16_t> normalized(256, 0);
+    int64_t sum = 0;
+    for (int s = 0; s < 256; ++s) {
+        if (!counts[s]) continue;
+        uint64_t scaled = (uint64_t(counts[s]) * tableSize + total / 2) / total;
+        normalized[s] = static_cast<uint16_t>(max<uint64_t>(scaled, 1));
+        sum += normalized[s];
+    }
+
+    // Rounding leaves the sum a little off, move single slots to wherever they cost the fewest bits
+    while (sum > tableSize) {
+        int best = -1;
+        double bestCost = 1e300;
+        for (int s = 0; s < 256; ++s) {
+            if (normalized[s] <= 1) continue;
+            double cost = counts[s] * log2(double(normalized[s]) / (normalized[s] - 1));
+            if (cost < bestCost) {
+                bestCost = cost;
+                best = s;
+            }
+        }
+        --normalized[best];
+        --sum;
+    }
+    while (sum < tableSize) {
+        int best = -1;
+        double bestGain = -1;
+        for (int s = 0; s < 256; ++s) {
+            if (!counts[s]) continue;
+            double gain = counts[s] * log2(double(normalized[s] + 1) / normalized[s]);
+            if (gain > bestGain) {
+                bestGain = gain;
+                best = s;
+            }
+        }
+        ++normalized[best];
+        ++sum;
+    }
+    return normalized;
+}
+
+double FSE::estimateBits(const uint32_t counts[256], const vector<uint16_t>& normalized, int tableLog) {
+    double bits = 0;
+    for (int s = 0; s < 256; ++s) {
+        if (counts[s]) bits += counts[s] * (tableLog - log2(double(normalized[s])));
+    }
+    return bits;
+}
+
+vector<unsigned char> FSE::spreadSymbols(const vector<uint16_t>& normalized, int tableLog) {
+    if (tableLog < MIN_TABLE_LOG || tableLog > MAX_TABLE_LOG || normalized.size() != 256) {
+        throw std::runtime_error("Invalid tANS table");
+    }
+    const uint32_t tableSize = 1u << tableLog;
+    uint32_t sum = 0;
+    for (uint16_t n : normalized) sum += n;
+    if (sum != tableSize) throw std::runtime_error("Invalid tANS table");
+
+    // The step is odd, so it visits every slot of the power of two table once
+    const uint32_t mask = tableSize - 1;
+    const uint32_t step = (tableSize >> 1) + (tableSize >> 3) + 3;
+    vector<unsigned char> symbols(tableSize);
+    uint32_t position = 0;
+    for (int s = 0; s < 256; ++s) {
+        for (uint32_t i = 0; i < normalized[s]; ++i) {
+            symbols[position] = static_cast<unsigned char>(s);
+            position = (position + step) & mask;
+        }
+    }
+    return symbols;
+}
+
+FSEEncodeTable FSE::buildEncodeTable(const vector<uint16_t>& normalized, int tableLog) {
+    vector<unsigned char> symbols = spreadSymbols(normalized, tableLog);
+    const uint32_t tableSize = 1u << tableLog;
+
+    FSEEncodeTable table;
+    table.tableLog = tableLog;
+    table.stateTable.resize(tableSize);
+    uint32_t cumulative[257];
+    cumulative[0] = 0;
+    for (int s = 0; s < 256; ++s) cumulative[s + 1] = cumulative[s] + normalized[s];
+
+    // States of each symbol, in table order, grouped by symbol
+    uint32_t next[256];
+    copy(cumulative, cumulative + 256, next);
+    for (uint32_t u = 0; u < tableSize; ++u) {
+        table.stateTable[next[symbols[u]]++] = static_cast<uint16_t>(tableSize + u);
+    }
+
+    for (int s = 0; s < 256; ++s) {
+        FSEEncodeTable::SymbolTransform& transform = table.symbols[s];
+        uint32_t n = normalized[s];
+        if (n == 0) {
+            transform.deltaFindState = 0;
+            transform.deltaNbBits = 0;
+        } else if (n == 1) {
+            transform.deltaFindState = int32_t(cumulative[s]) - 1;
+            transform.deltaNbBits = (uint32_t(tableLog) << 16) - tableSize;
+        } else {
+            // A symbol with n slots outputs maxBitsOut bits from states at or above n << maxBitsOut, one less below
+            uint32_t maxBitsOut = tableLog - highBit(n - 1);
+            transform.deltaFindState = int32_t(cumulative[s]) - int32_t(n);
+            transform.deltaNbBits = (maxBitsOut << 16) - (n << maxBitsOut);
+        }
+    }
+    return table;
+}
+
+FSEDecodeTable FSE::buildDecodeTable(const vector<uint16_t>& normalized, int tableLog) {
+    vector<unsigned char> symbols = spreadSymbols(normalized, tableLog);
+    const uint32_t tableSize = 1u << tableLog;
+
+    FSEDecodeTable table;
+    table.tableLog = tableLog;
+    table.entries.resize(tableSize);
+    uint32_t next[256];
+    for (int s = 0; s < 256; ++s) next[s] = normalized[s];
+    for (uint32_t u = 0; u < tableSize; ++u) {
+        unsigned char symbol = symbols[u];
+        uint32_t nextState = next[symbol]++;
+        unsigned char nbBits = static_cast<unsigned char>(tableLog - highBit(nextState));
+        table.entries[u].symbol = symbol;
+        table.entries[u].nbBits = nbBits;
+        table.entries[u].newState = static_cast<uint16_t>((nextState << nbBits) - tableSize);
+    }
+    return table;
+}
+
+vector<unsigned char> FSE::encode(const unsigned char* input, size_t size, const FSEEncodeTable& table) {
+    TRACE_SCOPE("fse_encode");
+    vector<unsigned char> output;
+    output.reserve(size + 16);
+
+    // Bits go in at the low end of a 64 bit buffer and leave four bytes at a time
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    auto addBits = [&](uint32_t value, int nbBits) {
+        bitBuffer |= uint64_t(value & ((1u << nbBits) - 1)) << bitCount;
+        bitCount += nbBits;
+    };
+    auto flush = [&](int minimum) {
+        while (bitCount >= minimum && bitCount > 0) {
+            output.push_back(static_cast<unsigned char>(bitBuffer));
+            bitBuffer >>= 8;
+            bitCount = max(bitCount - 8, 0);
+        }
+    };
+
+    // The decoder runs forwards, so the encoder runs backwards
+    const uint32_t tableSize = 1u << table.tableLog;
+    const uint16_t* stateTable = table.stateTable.data();
+    uint32_t states[STATES];
+    for (int k = 0; k < STATES; ++k) states[k] = tableSize;
+    for (size_t i = size; i-- > 0;) {
+        uint32_t& state = states[i % STATES];
+        const FSEEncodeTable::SymbolTransform& transform = table.symbols[input[i]];
+        int nbBits = static_cast<int>((state + transform.deltaNbBits) >> 16);
+        addBits(state, nbBits);
+        state = stateTable[(state >> nbBits) + transform.deltaFindState];
+        if (bitCount >= 32) flush(8);
+    }
+    for (int k = 0; k < STATES; ++k) {
+        addBits(states[k] - tableSize, table.tableLog);
+        flush(8);
+    }
+    addBits(1, 1);
+    flush(1);
+    return output;
+}
+
+// Reads backwards from the end marker, each read takes the bits just below position
+struct BackwardBitReader {
+    const unsigned char* input;
+    size_t size;
+    size_t position;
+};
+
+static inline uint32_t readBits(BackwardBitReader& reader, int nbBits) {
+    if (size_t(nbBits) > reader.position) throw std::runtime_error("Truncated tANS stream");
+    reader.position -= nbBits;
+    size_t index = reader.position >> 3;
+    uint64_t word = 0;
+    if (index + 8 <= reader.size) {
+        memcpy(&word, reader.input + index, 8);
+    } else {
+        for (size_t i = index; i < reader.size; ++i) word |= uint64_t(reader.input[i]) << (8 * (i - index));
+    }
+    return static_cast<uint32_t>(word >> (reader.position & 7)) & ((1u << nbBits) - 1);
+}
+
+// False unless the stream ends where the encoder started, every state back at 0 and every bit read
+static inline bool decodeSymbols(BackwardBitReader& reader, const FSEDecodeTable& table, unsigned char* output, size_t count) {
+    uint32_t states[FSE::STATES];
+    for (int k = FSE::STATES - 1; k >= 0; --k) states[k] = readBits(reader, table.tableLog);
+
+    const FSEDecodeTable::Entry* entries = table.entries.data();
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t& state = states[i % FSE::STATES];
+        const FSEDecodeTable::Entry& entry = entries[state];
+        output[i] = entry.symbol;
+        state = entry.newState + readBits(reader, entry.nbBits);
+    }
+    bool ended = reader.position == 0;
+    for (int k = 0; k < FSE::STATES; ++k) ended = ended && states[k] == 0;
+    return ended;
+}
+
+static bool decodeSymbolsDefault(BackwardBitReader& reader, const FSEDecodeTable& table, unsigned char* output, size_t count) {
+    return decodeSymbols(reader, table, output, count);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Same loop with BMI2, the variable shifts and masks of the bit reads become shrx and bzhi
+__attribute__((target("bmi2")))
+static bool decodeSymbolsBmi2(BackwardBitReader& reader, const FSEDecodeTable& table, unsigned char* output, size_t count) {
+    return decodeSymbols(reader, table, output, count);
+}
+#endif
+
+vector<unsigned char> FSE::decode(const unsigned char* input, size_t size, size_t count, const FSEDecodeTable& table) {
+    TRACE_SCOPE("fse_decode");
+    if (size == 0 || input[size - 1] == 0) throw std::runtime_error("Invalid tANS stream");
+
+    BackwardBitReader reader = {input, size, (size - 1) * 8 + highBit(input[size - 1])};
+    vector<unsigned char> output(count);
+    bool ended;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (Kernels::hasBmi2()) {
+        ended = decodeSymbolsBmi2(reader, table, output.data(), count);
+    } else {
+        ended = decodeSymbolsDefault(reader, table, output.data(), count);
+    }
+#else
+    ended = decodeSymbolsDefault(reader, table, output.data(), count);
+#endif
+    if (!ended) throw std::runtime_error("Corrupt tANS stream");
+    return output;
+}
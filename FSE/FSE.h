@@ -0,0 +1,60 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Table based asymmetric numeral system (tANS) coder, in the FSE layout
+// Symbol probabilities are normalized counts summing to 1 << tableLog, so unlike Huffman a symbol can cost a
+// fraction of a bit; a byte with 90% probability costs 0.15 bits instead of a whole one
+
+// Per symbol transform for the encoder, state is kept in [L, 2L)
+struct FSEEncodeTable {
+    struct SymbolTransform {
+        int32_t deltaFindState;
+        uint32_t deltaNbBits;
+    };
+    int tableLog = 0;
+    vector<uint16_t> stateTable;
+    SymbolTransform symbols[256];
+};
+
+// One entry per decoder state in [0, L)
+struct FSEDecodeTable {
+    struct Entry {
+        uint16_t newState;
+        unsigned char symbol;
+        unsigned char nbBits;
+    };
+    int tableLog = 0;
+    vector<Entry> entries;
+};
+
+class FSE {
+public:
+    static const int MIN_TABLE_LOG = 5;
+    static const int DEFAULT_TABLE_LOG = 11;
+    static const int MAX_TABLE_LOG = 12;
+    // Interleaved states sharing one bit stream, symbol i is coded by state i % STATES
+    static const int STATES = 4;
+
+    // Smaller tables for short inputs, large enough to give every present symbol a slot
+    static int optimalTableLog(size_t total, int symbolCount);
+    // Scales counts to sum to 1 << tableLog, every present symbol gets at least 1
+    static vector<uint16_t> normalizeCounts(const uint32_t counts[256], int tableLog);
+    // Coded size in bits of data with these counts under a normalized table, excluding any header
+    static double estimateBits(const uint32_t counts[256], const vector<uint16_t>& normalized, int tableLog);
+
+    static FSEEncodeTable buildEncodeTable(const vector<uint16_t>& normalized, int tableLog);
+    static FSEDecodeTable buildDecodeTable(const vector<uint16_t>& normalized, int tableLog);
+
+    // The bit stream is written forwards and read backwards, it ends with a 1 bit marking its length. decode throws
+    // unless count symbols use up every bit and leave each state where the encoder started
+    vector<unsigned char> encode(const unsigned char* input, size_t size, const FSEEncodeTable& table);
+    vector<unsigned char> decode(const unsigned char* input, size_t size, size_t count, const FSEDecodeTable& table);
+
+private:
+    // Slots of each symbol are scattered over the table so its states are spread out evenly
+    static vector<unsigned char> spreadSymbols(const vector<uint16_t>& normalized, int tableLog);
+};
@@ -1,12 +1,19 @@
 #include "Huffman.h"
+#include "Trace/Trace.h"
+#include "Kernels/Kernels.h"
 #include <bitset>
 #include <deque>
 #include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
 unordered_map<unsigned char, int> Huffman::countBytes(const vector<unsigned char>& input) {
+    TRACE_SCOPE("histogram");
+    uint32_t counts[256] = {0};
+    Kernels::active().histogram(input.data(), input.size(), counts);
     unordered_map<unsigned char, int> freq;
-    for (const auto& byte : input) {
-        ++freq[byte];
+    for (int byte = 0; byte < 256; ++byte) {
+        if (counts[byte]) freq[static_cast<unsigned char>(byte)] = static_cast<int>(counts[byte]);
     }
     return freq;
 }
@@ -59,15 +66,21 @@ void Huffman::traverseHuffmanTree(Node* node, string& code, int length, unordere
 }
 
 unordered_map<unsigned char, string> Huffman::generateHuffmanCodes(const vector<unsigned char>& input) {
-    unordered_map<unsigned char, int> freq = countBytes(input);
+    return generateHuffmanCodes(countBytes(input));
+}
+
+unordered_map<unsigned char, string> Huffman::generateHuffmanCodes(const unordered_map<unsigned char, int>& freq) {
+    TRACE_SCOPE("tree_build");
     priority_queue<Node*, vector<Node*>, Compare> nodes = createNodes(freq);
     Node* root = buildTree(nodes);
     unordered_map<unsigned char, string> huffmanCodes;
     string code(256, '\0');
-    traverseHuffmanTree(root, code, 0, huffmanCodes);
+    if (root) traverseHuffmanTree(root, code, 0, huffmanCodes);
+    deleteTree(root);
     return huffmanCodes;
 }
 vector<unsigned char> Huffman::encode(const vector<unsigned char>& input, const unordered_map<unsigned char, string>& huffmanCodes) {
+    TRACE_SCOPE("huffman_encode");
     vector<unsigned char> encoded;
     int length = 0;
     unsigned char byte = 0;
@@ -89,6 +102,10 @@ vector<unsigned char> Huffman::encode(const vector<unsigned char>& input, const
         // Add an extra byte that contains the number of valid bits in the last byte
         encoded.push_back(length);
     }
+    else if (!encoded.empty()) {
+        // The decoders always read the extra byte, so a full last byte still needs one
+        encoded.push_back(8);
+    }
     return encoded;
 }
 
@@ -112,6 +129,7 @@ TrieNode* Huffman::buildTrie(const unordered_map<unsigned char, string>& huffman
 }
 
 vector<unsigned char> Huffman::decode(const vector<unsigned char>& input, TrieNode* root) {
+    TRACE_SCOPE("huffman_decode");
     vector<unsigned char> decoded;
 
     // Always read the extra byte that contains the number of valid bits in the last byte
@@ -202,7 +220,8 @@ unordered_map<unsigned char, string> Huffman::deque_generateHuffmanCodes(const v
     Node* root = deque_buildTree(nodes);
     unordered_map<unsigned char, string> huffmanCodes;
     string code(256, '\0');
-    deque_traverseHuffmanTree(root, code, 0, huffmanCodes);
+    if (root) deque_traverseHuffmanTree(root, code, 0, huffmanCodes);
+    deleteTree(root);
     return huffmanCodes;
 }
 
@@ -228,6 +247,10 @@ vector<unsigned char> Huffman::deque_encode(const vector<unsigned char>& input,
         // Add an extra byte that contains the number of valid bits in the last byte
         encoded.push_back(length);
     }
+    else if (!encoded.empty()) {
+        // The decoders always read the extra byte, so a full last byte still needs one
+        encoded.push_back(8);
+    }
     return encoded;
 }
 
@@ -271,4 +294,292 @@ vector<unsigned char> Huffman::deque_decode(const vector<unsigned char>& input,
     }
 
     return decoded;
-}
\ No newline at end of file
+}
+
+void Huffman::deleteTree(Node* node) {
+    if (node == nullptr) return;
+    deleteTree(node->left);
+    deleteTree(node->right);
+    delete node;
+}
+
+void Huffman::deleteTrie(TrieNode* node) {
+    if (node == nullptr) return;
+    deleteTrie(node->children[0]);
+    deleteTrie(node->children[1]);
+    delete node;
+}
+
+////STATIC TABLES
+const int HuffmanDecodeTable::MAX_LENGTH;
+const unsigned char Huffman::FIXED_TABLE_ID;
+const unsigned char Huffman::RESERVED_TABLE_ID;
+
+unordered_map<unsigned char, string> Huffman::canonicalCodes(vector<pair<unsigned char, int>> codeLengths) {
+    for (auto& pair : codeLengths) {
+        pair.second = max(pair.second, 1); // A tree with a single leaf gives it an empty code
+    }
+    sort(codeLengths.begin(), codeLengths.end(), [](const pair<unsigned char, int>& a, const pair<unsigned char, int>& b) {
+        return a.second == b.second ? a.first < b.first : a.second < b.second;
+    });
+
+    unordered_map<unsigned char, string> huffmanCodes;
+    uint64_t code = 0;
+    int previousLength = codeLengths.empty() ? 0 : codeLengths.front().second;
+    for (const auto& pair : codeLengths) {
+        code <<= (pair.second - previousLength);
+        previousLength = pair.second;
+        string bits(pair.second, '0');
+        for (int i = 0; i < pair.second; ++i) {
+            if ((code >> (pair.second - 1 - i)) & 1) bits[i] = '1';
+        }
+        huffmanCodes[pair.first] = bits;
+        ++code;
+    }
+    return huffmanCodes;
+}
+
+HuffmanDecodeTable Huffman::buildDecodeTable(const unordered_map<unsigned char, string>& huffmanCodes) {
+    HuffmanDecodeTable table;
+    for (const auto& pair : huffmanCodes) {
+        if (pair.second.size() > HuffmanDecodeTable::MAX_LENGTH) {
+            return HuffmanDecodeTable(); // Too long for a flat table, callers fall back to the trie
+        }
+        table.maxLength = max(table.maxLength, static_cast<int>(pair.second.size()));
+    }
+    if (table.maxLength == 0) return table;
+
+    table.entries.assign(size_t(1) << table.maxLength, 0);
+    for (const auto& pair : huffmanCodes) {
+        int length = pair.second.size();
+        size_t code = 0;
+        for (char bit : pair.second) {
+            code = (code << 1) | (bit - '0');
+        }
+        // Every index that starts with this code maps to it, whatever the trailing bits are
+        size_t first = code << (table.maxLength - length);
+        size_t last = (code + 1) << (table.maxLength - length);
+        for (size_t i = first; i < last; ++i) {
+            table.entries[i] = static_cast<uint16_t>((pair.first << 8) | length);
+        }
+    }
+    return table;
+}
+
+vector<unsigned char> Huffman::decode(const vector<unsigned char>& input, const HuffmanDecodeTable& table) {
+    TRACE_SCOPE("huffman_decode");
+    vector<unsigned char> decoded;
+    if (input.size() < 2 || table.maxLength == 0) return decoded;
+
+    // Same layout as encode(): data bytes followed by the number of valid bits in the last one
+    size_t validBitsInLastByte = static_cast<size_t>(input.back());
+    size_t inputSize = input.size() - 1;
+    size_t totalBits = 8 * (inputSize - 1) + validBitsInLastByte;
+    decoded.reserve(inputSize * 2);
+
+    // Bits are kept left aligned in a 64 bit buffer and refilled a byte at a time
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    size_t bytePos = 0;
+    size_t bitsRead = 0;
+    while (bitsRead < totalBits) {
+        while (bitCount <= 56 && bytePos < inputSize) {
+            bitBuffer |= static_cast<uint64_t>(input[bytePos++]) << (56 - bitCount);
+            bitCount += 8;
+        }
+        uint16_t entry = table.entries[bitBuffer >> (64 - table.maxLength)];
+        int length = entry & 0xFF;
+        if (length == 0 || bitsRead + length > totalBits) break;
+
+        decoded.push_back(static_cast<unsigned char>(entry >> 8));
+        bitBuffer <<= length;
+        bitCount -= length;
+        bitsRead += length;
+    }
+
+    // The encoder writes exactly totalBits, so anything left over is a corrupt stream
+    if (bitsRead != totalBits) throw std::runtime_error("Invalid Huffman code");
+    return decoded;
+}
+
+size_t Huffman::decodeRange(const vector<unsigned char>& input, size_t startBit, size_t count, const HuffmanDecodeTable& table,
+                            unsigned char* output) {
+    if (count == 0) return startBit;
+    if (input.size() < 2 || table.maxLength == 0) return SIZE_MAX;
+    size_t inputSize = input.size() - 1;
+    size_t totalBits = 8 * (inputSize - 1) + static_cast<size_t>(input.back());
+    if (startBit >= totalBits) return SIZE_MAX;
+
+    // Same reader as decode(), started mid byte
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    size_t bytePos = startBit >> 3;
+    size_t bitsRead = startBit;
+    int skip = static_cast<int>(startBit & 7);
+    while (bitCount <= 56 && bytePos < inputSize) {
+        bitBuffer |= static_cast<uint64_t>(input[bytePos++]) << (56 - bitCount);
+        bitCount += 8;
+    }
+    bitBuffer <<= skip;
+    bitCount -= skip;
+    for (size_t i = 0; i < count; ++i) {
+        while (bitCount <= 56 && bytePos < inputSize) {
+            bitBuffer |= static_cast<uint64_t>(input[bytePos++]) << (56 - bitCount);
+            bitCount += 8;
+        }
+        uint16_t entry = table.entries[bitBuffer >> (64 - table.maxLength)];
+        int length = entry & 0xFF;
+        if (length == 0 || bitsRead + length > totalBits) return SIZE_MAX;
+
+        output[i] = static_cast<unsigned char>(entry >> 8);
+        bitBuffer <<= length;
+        bitCount -= length;
+        bitsRead += length;
+    }
+    return bitsRead;
+}
+
+static mutex tableMutex;
+
+static map<unsigned char, shared_ptr<const StaticHuffmanTable>>& tableRegistry() {
+    static map<unsigned char, shared_ptr<const StaticHuffmanTable>> registry;
+    return registry;
+}
+
+static shared_ptr<const StaticHuffmanTable> makeFixedTable() {
+    // Code lengths of the full DEFLATE literal/length alphabet, codes are assigned canonically over all 288
+    // symbols so the byte values 0-255 get exactly the codes RFC 1951 gives the literals
+    vector<int> lengths(288);
+    for (int i = 0; i < 288; ++i) {
+        lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    int lengthCount[16] = {0};
+    for (int length : lengths) ++lengthCount[length];
+    int nextCode[16] = {0};
+    for (int bits = 1, code = 0; bits < 16; ++bits) {
+        code = (code + lengthCount[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    shared_ptr<StaticHuffmanTable> table = make_shared<StaticHuffmanTable>();
+    table->id = Huffman::FIXED_TABLE_ID;
+    for (int symbol = 0; symbol < 288; ++symbol) {
+        int code = nextCode[lengths[symbol]]++;
+        if (symbol > 255) continue;
+        string bits(lengths[symbol], '0');
+        for (int i = 0; i < lengths[symbol]; ++i) {
+            if ((code >> (lengths[symbol] - 1 - i)) & 1) bits[i] = '1';
+        }
+        table->codes[static_cast<unsigned char>(symbol)] = bits;
+    }
+    table->decodeTable = Huffman::buildDecodeTable(table->codes);
+    return table;
+}
+
+const StaticHuffmanTable& Huffman::fixedTable() {
+    // Function local static so it is built exactly once, even with several threads racing to it
+    static shared_ptr<const StaticHuffmanTable> table = makeFixedTable();
+    return *table;
+}
+
+// Build the fixed table during static initialisation rather than on the first compress
+static const StaticHuffmanTable& fixedTableAtStartup = Huffman::fixedTable();
+
+shared_ptr<const StaticHuffmanTable> Huffman::registerTable(unsigned char id, const unordered_map<unsigned char, string>& huffmanCodes,
+                                                         bool selectable) {
+    if (id == 0 || id == FIXED_TABLE_ID || id == RESERVED_TABLE_ID) {
+        throw std::runtime_error("Static Huffman table id is reserved");
+    }
+    shared_ptr<StaticHuffmanTable> table = make_shared<StaticHuffmanTable>();
+    table->id = id;
+    table->codes = huffmanCodes;
+    table->decodeTable = buildDecodeTable(huffmanCodes);
+    table->selectable = selectable;
+    if (table->decodeTable.maxLength == 0) {
+        throw std::runtime_error("Static Huffman tables are limited to 15 bit codes");
+    }
+
+    lock_guard<mutex> lock(tableMutex);
+    shared_ptr<const StaticHuffmanTable>& slot = tableRegistry()[id];
+    if (slot) {
+        if (slot->codes != huffmanCodes || slot->selectable != selectable) {
+            throw std::runtime_error("Static Huffman table id " + to_string(id) + " already holds another table");
+        }
+        return slot;
+    }
+    slot = table;
+    return table;
+}
+
+void Huffman::unregisterTable(unsigned char id) {
+    lock_guard<mutex> lock(tableMutex);
+    tableRegistry().erase(id);
+}
+
+shared_ptr<const StaticHuffmanTable> Huffman::findTable(unsigned char id) {
+    if (id == FIXED_TABLE_ID) {
+        // Aliasing constructor, the fixed table lives for the whole program so nothing needs to own it
+        return shared_ptr<const StaticHuffmanTable>(shared_ptr<const StaticHuffmanTable>(), &fixedTable());
+    }
+    lock_guard<mutex> lock(tableMutex);
+    auto it = tableRegistry().find(id);
+    return it == tableRegistry().end() ? nullptr : it->second;
+}
+
+size_t Huffman::encodedBits(const unordered_map<unsigned char, int>& frequencies, const unordered_map<unsigned char, string>& huffmanCodes) {
+    size_t bits = 0;
+    for (const auto& pair : frequencies) {
+        auto code = huffmanCodes.find(pair.first);
+        if (code == huffmanCodes.end()) return SIZE_MAX; // Table can't encode this input at all
+        bits += static_cast<size_t>(pair.second) * code->second.size();
+    }
+    return bits;
+}
+
+size_t Huffman::codeTableBits(const unordered_map<unsigned char, string>& huffmanCodes) {
+    // Matches the layout written by writeCompressedData: a size_t count, then byte, size_t length, packed code
+    size_t bytes = sizeof(size_t);
+    for (const auto& pair : huffmanCodes) {
+        bytes += 1 + sizeof(size_t) + (pair.second.size() + 7) / 8;
+    }
+    return bytes * 8;
+}
+
+size_t Huffman::dynamicLowerBoundBits(const unordered_map<unsigned char, int>& frequencies, size_t tableBytesPerCode) {
+    // Entropy of the input plus the smallest possible code table, no Huffman code can beat this
+    double total = 0;
+    for (const auto& pair : frequencies) total += pair.second;
+    double bits = 0;
+    for (const auto& pair : frequencies) {
+        bits += pair.second * log2(total / pair.second);
+    }
+    return static_cast<size_t>(bits) + (sizeof(size_t) + frequencies.size() * tableBytesPerCode) * 8;
+}
+
+shared_ptr<const StaticHuffmanTable> Huffman::selectStaticTable(const unordered_map<unsigned char, int>& frequencies, size_t tableBytesPerCode,
+                                                             const shared_ptr<const StaticHuffmanTable>& extra) {
+    vector<shared_ptr<const StaticHuffmanTable>> candidates;
+    candidates.push_back(findTable(FIXED_TABLE_ID));
+    if (extra) candidates.push_back(extra);
+    {
+        lock_guard<mutex> lock(tableMutex);
+        for (const auto& pair : tableRegistry()) {
+            if (pair.second->selectable) candidates.push_back(pair.second);
+        }
+    }
+
+    shared_ptr<const StaticHuffmanTable> best;
+    size_t bestBits = SIZE_MAX;
+    for (const auto& table : candidates) {
+        size_t bits = encodedBits(frequencies, table->codes);
+        if (bits < bestBits) {
+            bestBits = bits;
+            best = table;
+        }
+    }
+    // A static table still costs the empty count and its id byte in the header
+    if (best && bestBits != SIZE_MAX && bestBits + (sizeof(size_t) + 1) * 8 <= dynamicLowerBoundBits(frequencies, tableBytesPerCode)) {
+        return best;
+    }
+    return nullptr;
+}
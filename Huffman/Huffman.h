@@ -7,6 +7,10 @@
 #include <algorithm>
 #include <deque>
 #include <queue>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
 
 using namespace std;
 
@@ -24,6 +28,23 @@ struct TrieNode {
     bool isEndOfCode = false;
 };
 
+// Flat lookup table for prefix codes up to MAX_LENGTH bits, indexed by the next maxLength bits of input
+// Each entry is (symbol << 8) | code length, a length of 0 marks bits that do not start a valid code
+struct HuffmanDecodeTable {
+    static const int MAX_LENGTH = 15;
+    int maxLength = 0;
+    vector<uint16_t> entries;
+};
+
+// Pre-built table that both sides know in advance, so no code table needs to be serialised
+// Built once and shared read-only between threads
+struct StaticHuffmanTable {
+    unsigned char id;
+    unordered_map<unsigned char, string> codes;
+    HuffmanDecodeTable decodeTable;
+    bool selectable = true; // Offered by selectStaticTable, false for tables only the code that registered them passes in
+};
+
 struct Compare {
     bool operator()(Node* a, Node* b) {
         if (a->freq == b->freq) {
@@ -63,4 +84,42 @@ public:
 
     vector<unsigned char>
     deque_decode(const vector<unsigned char> &input, const unordered_map<unsigned char, string> &huffmanCodes);
+
+    //// STATIC TABLES
+    static const unsigned char FIXED_TABLE_ID = 1; // DEFLATE fixed literal codes (RFC 1951 3.2.6)
+    static const unsigned char RESERVED_TABLE_ID = 0xFF; // Marks a block coded with something other than Huffman
+
+    unordered_map<unsigned char, string> generateHuffmanCodes(const unordered_map<unsigned char, int>& frequencies);
+    vector<unsigned char> decode(const vector<unsigned char>& input, const HuffmanDecodeTable& table);
+    // Decodes count symbols of encode()'s output starting at bit startBit, so one stream can be decoded in pieces
+    // from known code boundaries. Returns the bit after the last symbol, or SIZE_MAX if the stream ends or holds an
+    // invalid code first
+    static size_t decodeRange(const vector<unsigned char>& input, size_t startBit, size_t count, const HuffmanDecodeTable& table,
+                              unsigned char* output);
+
+    // Assigns codes in canonical order (by length, then byte) so only the lengths have to be stored
+    static unordered_map<unsigned char, string> canonicalCodes(vector<pair<unsigned char, int>> codeLengths);
+    // The trees and tries are plain new'd nodes, these free a whole one
+    static void deleteTree(Node* node);
+    static void deleteTrie(TrieNode* node);
+
+    static HuffmanDecodeTable buildDecodeTable(const unordered_map<unsigned char, string>& huffmanCodes);
+    static const StaticHuffmanTable& fixedTable();
+    // Registering the same codes again returns the existing table, an id that holds other codes throws. Streams
+    // coded with a table need it under the same id to decode, so an id is only reused after unregisterTable
+    static shared_ptr<const StaticHuffmanTable> registerTable(unsigned char id, const unordered_map<unsigned char, string>& huffmanCodes,
+                                                              bool selectable = true);
+    static shared_ptr<const StaticHuffmanTable> findTable(unsigned char id);
+    static void unregisterTable(unsigned char id);
+
+    // Size estimates in bits, used to decide whether a static table beats a dynamic one
+    static size_t encodedBits(const unordered_map<unsigned char, int>& frequencies, const unordered_map<unsigned char, string>& huffmanCodes);
+    static size_t codeTableBits(const unordered_map<unsigned char, string>& huffmanCodes);
+    static size_t dynamicLowerBoundBits(const unordered_map<unsigned char, int>& frequencies, size_t tableBytesPerCode = 2 + sizeof(size_t));
+
+    // Returns the cheapest static table for these frequencies, or nullptr if a dynamic table is expected to win
+    // tableBytesPerCode is what the caller's format spends on each entry of a dynamic table. extra, when given, is a
+    // candidate too, which is how a caller offers a table registered as not selectable
+    shared_ptr<const StaticHuffmanTable> selectStaticTable(const unordered_map<unsigned char, int>& frequencies, size_t tableBytesPerCode = 2 + sizeof(size_t),
+                                                           const shared_ptr<const StaticHuffmanTable>& extra = nullptr);
 };
\ No newline at end of file
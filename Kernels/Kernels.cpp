@@ -0,0 +1,192 @@
+#include "Kernels.h"
+#include <cstring>
+#include <cstdlib>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+const size_t Kernels::COPY_SLACK;
+
+//// SCALAR
+// Shared bodies, inlined into each ISA's wrapper so the compiler can use that ISA for them
+
+static inline size_t matchLengthBody(const unsigned char* a, const unsigned char* b, size_t k, size_t limit) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Eight bytes at a time, the first differing byte is the lowest set bit of the xor
+    while (k + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + k, 8);
+        memcpy(&y, b + k, 8);
+        uint64_t diff = x ^ y;
+        if (diff) return k + (__builtin_ctzll(diff) >> 3);
+        k += 8;
+    }
+#endif
+    while (k < limit && a[k] == b[k]) ++k;
+    return k;
+}
+
+// A scatter increment doesn't vectorize, so every table shares this one. Four tables, so runs of the same byte
+// don't serialize on one counter
+static void histogramScalar(const unsigned char* data, size_t size, uint32_t counts[256]) {
+    uint32_t partial[4][256];
+    memset(partial, 0, sizeof(partial));
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        ++partial[0][data[i]];
+        ++partial[1][data[i + 1]];
+        ++partial[2][data[i + 2]];
+        ++partial[3][data[i + 3]];
+    }
+    for (; i < size; ++i) ++partial[0][data[i]];
+    for (int s = 0; s < 256; ++s) {
+        counts[s] += partial[0][s] + partial[1][s] + partial[2][s] + partial[3][s];
+    }
+}
+
+static inline void copyMatchBody(unsigned char* out, size_t offset, size_t length) {
+    const unsigned char* from = out - offset;
+    if (offset >= 8) {
+        // Each chunk only reads bytes that are already written
+        for (size_t i = 0; i < length; i += 8) memcpy(out + i, from + i, 8);
+        return;
+    }
+    for (size_t i = 0; i < length; ++i) out[i] = from[i];
+}
+
+static size_t matchLengthScalar(const unsigned char* a, const unsigned char* b, size_t limit) {
+    return matchLengthBody(a, b, 0, limit);
+}
+
+static void copyMatchScalar(unsigned char* out, size_t offset, size_t length) {
+    copyMatchBody(out, offset, length);
+}
+
+static const KernelTable SCALAR_TABLE = {KernelIsa::Scalar, "scalar", matchLengthScalar, histogramScalar, copyMatchScalar};
+
+#ifdef KERNELS_X86
+//// SSE2
+__attribute__((target("sse2")))
+static size_t matchLengthSse2(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t k = 0;
+    for (; k + 16 <= limit; k += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + k));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + k));
+        unsigned equal = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+        if (equal != 0xFFFF) return k + __builtin_ctz(~equal);
+    }
+    return matchLengthBody(a, b, k, limit);
+}
+
+__attribute__((target("sse2")))
+static void copyMatchSse2(unsigned char* out, size_t offset, size_t length) {
+    if (offset < 16) return copyMatchBody(out, offset, length);
+    const unsigned char* from = out - offset;
+    for (size_t i = 0; i < length; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + i)));
+    }
+}
+
+//// AVX2
+__attribute__((target("avx2")))
+static size_t matchLengthAvx2(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t k = 0;
+    for (; k + 32 <= limit; k += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + k));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k));
+        uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (equal != 0xFFFFFFFFu) return k + __builtin_ctz(~equal);
+    }
+    return matchLengthBody(a, b, k, limit);
+}
+
+__attribute__((target("avx2")))
+static void copyMatchAvx2(unsigned char* out, size_t offset, size_t length) {
+    if (offset < 32) return copyMatchSse2(out, offset, length);
+    const unsigned char* from = out - offset;
+    for (size_t i = 0; i < length; i += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from + i)));
+    }
+}
+
+//// AVX-512
+__attribute__((target("avx512f,avx512bw")))
+static size_t matchLengthAvx512(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t k = 0;
+    for (; k + 64 <= limit; k += 64) {
+        __m512i x = _mm512_loadu_si512(a + k);
+        __m512i y = _mm512_loadu_si512(b + k);
+        uint64_t differ = _mm512_cmpneq_epi8_mask(x, y);
+        if (differ) return k + __builtin_ctzll(differ);
+    }
+    return matchLengthBody(a, b, k, limit);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void copyMatchAvx512(unsigned char* out, size_t offset, size_t length) {
+    if (offset < 64) return copyMatchAvx2(out, offset, length);
+    const unsigned char* from = out - offset;
+    for (size_t i = 0; i < length; i += 64) {
+        _mm512_storeu_si512(out + i, _mm512_loadu_si512(from + i));
+    }
+}
+
+static const KernelTable SSE2_TABLE = {KernelIsa::SSE2, "sse2", matchLengthSse2, histogramScalar, copyMatchSse2};
+static const KernelTable AVX2_TABLE = {KernelIsa::AVX2, "avx2", matchLengthAvx2, histogramScalar, copyMatchAvx2};
+static const KernelTable AVX512_TABLE = {KernelIsa::AVX512, "avx512", matchLengthAvx512, histogramScalar, copyMatchAvx512};
+#endif
+
+//// DISPATCH
+const KernelTable* Kernels::forIsa(KernelIsa isa) {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    switch (isa) {
+        case KernelIsa::SSE2:
+            return __builtin_cpu_supports("sse2") ? &SSE2_TABLE : nullptr;
+        case KernelIsa::AVX2:
+            return __builtin_cpu_supports("avx2") ? &AVX2_TABLE : nullptr;
+        case KernelIsa::AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") ? &AVX512_TABLE : nullptr;
+        default:
+            break;
+    }
+#endif
+    return isa == KernelIsa::Scalar ? &SCALAR_TABLE : nullptr;
+}
+
+// The widest ISA allowed by DEFLATE_KERNELS, or all of them
+static KernelIsa isaLimit() {
+    const char* value = getenv("DEFLATE_KERNELS");
+    if (!value) return KernelIsa::AVX512;
+    string name = value;
+    if (name == "scalar") return KernelIsa::Scalar;
+    if (name == "sse2") return KernelIsa::SSE2;
+    if (name == "avx2") return KernelIsa::AVX2;
+    return KernelIsa::AVX512;
+}
+
+static const KernelTable* chooseTable() {
+    for (int isa = static_cast<int>(isaLimit()); isa > 0; --isa) {
+        const KernelTable* table = Kernels::forIsa(static_cast<KernelIsa>(isa));
+        if (table) return table;
+    }
+    return &SCALAR_TABLE;
+}
+
+const KernelTable& Kernels::active() {
+    static const KernelTable* table = chooseTable();
+    return *table;
+}
+
+bool Kernels::hasBmi2() {
+#ifdef KERNELS_X86
+    // BMI2 came with AVX2, so a cap below AVX2 turns it off too
+    static const bool bmi2 = isaLimit() >= KernelIsa::AVX2 && (__builtin_cpu_init(), __builtin_cpu_supports("bmi2"));
+    return bmi2;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Hot loops compiled once per instruction set and picked at startup from what the CPU supports, so one
+// portable build still uses AVX2/AVX-512 where they exist. Only x86 with GCC or Clang gets the wider
+// versions, everything else runs the scalar ones.
+//
+// DEFLATE_KERNELS=scalar|sse2|avx2|avx512 in the environment caps the choice, for testing and benchmarks.
+//
+// Match length and copies have SIMD versions, the histogram is the same scalar loop everywhere. There are no bit
+// reader or Huffman decode kernels: the only decode path with an ISA variant is the tANS decoder, compiled a second
+// time for BMI2.
+
+enum class KernelIsa {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+struct KernelTable {
+    KernelIsa isa;
+    const char* name;
+
+    // Number of equal leading bytes of a and b, at most limit
+    size_t (*matchLength)(const unsigned char* a, const unsigned char* b, size_t limit);
+    // Adds the byte counts of data to counts. The same scalar multi-table loop in every table
+    void (*histogram)(const unsigned char* data, size_t size, uint32_t counts[256]);
+    // Appends length bytes starting offset bytes back, at out; offset may be less than length (a run)
+    // May write up to COPY_SLACK bytes past out + length, the buffer must have room for them
+    void (*copyMatch)(unsigned char* out, size_t offset, size_t length);
+};
+
+class Kernels {
+public:
+    static const size_t COPY_SLACK = 64;
+
+    // The table chosen for this CPU, looked up once
+    static const KernelTable& active();
+    // A specific table, nullptr when the build or the CPU can't run it
+    static const KernelTable* forIsa(KernelIsa isa);
+    // BMI2 (bzhi, shrx) is checked separately since some CPUs with AVX2 lack it. Off when DEFLATE_KERNELS is below avx2
+    static bool hasBmi2();
+};
@@ -1,7 +1,13 @@
 #include "LZ77.h"
+#include "Trace/Trace.h"
+#include "Kernels/Kernels.h"
+#include <cstring>
 #include <functional>
 
+const int RepeatOffsets::COUNT;
+
 vector<unsigned char> LZ77::loadFile(const string& filename) {
+    TRACE_SCOPE("file_read");
     // Open the file
     ifstream file(filename, ios::binary);
     if (!file.good()) {
@@ -17,6 +23,7 @@ vector<unsigned char> LZ77::loadFile(const string& filename) {
 }
 
 void LZ77::saveFile(const string& filename, const vector<unsigned char>& byteStream) {
+    TRACE_SCOPE("file_write");
     ofstream outfile(filename, ios::binary);
     if (!outfile) {
         throw std::runtime_error("Could not open file for writing");
@@ -235,13 +242,207 @@ vector<unsigned char> LZ77::rabin_karp_compress(const vector<unsigned char>& inp
     return tokensToByteStream(output);
 }
 
+vector<unsigned char> LZ77::hash_chain_compress(const vector<unsigned char>& input, int window_size, int chain_depth, int nice_length, bool lazy) {
+    return hash_chain_compress(input.data(), input.size(), window_size, chain_depth, nice_length, lazy);
+}
+
+vector<unsigned char> LZ77::hash_chain_compress(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy) {
+    LZ77Sequences sequences(memory);
+    hash_chain_parse(input, size, window_size, chain_depth, nice_length, lazy, sequences);
+    return sequencesToByteStream(sequences);
+}
+
+void LZ77::hash_chain_parse(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy,
+                            LZ77Sequences& sequences, int min_match, int hash_bits, int skip_trigger, size_t start) {
+    if (start > size) throw std::runtime_error("Parse starts past the end of its input");
+    HashChainParser parser = hash_chain_parser(window_size, min_match, hash_bits);
+    (this->*parser)(input, size, window_size, chain_depth, nice_length, lazy, sequences, skip_trigger, static_cast<int>(start));
+}
+
+// Hash of the first MIN_MATCH bytes at p, 3 bytes keep the multiplicative hash the format started with
+template <int MIN_MATCH, int HASH_BITS>
+static inline uint32_t hashBytes(const unsigned char* p) {
+    if (MIN_MATCH == 3) {
+        uint32_t bytes = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | p[2];
+        return (bytes * 2654435761u) >> (32 - HASH_BITS);
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < MIN_MATCH; ++i) bytes |= uint64_t(p[i]) << (8 * i);
+    return static_cast<uint32_t>((bytes * 0x9E3779B185EBCA87ull) >> (64 - HASH_BITS));
+}
+
+// WINDOW_SIZE 0 takes the window from window_size, anything else must equal it
+template <int WINDOW_SIZE, int MIN_MATCH, int HASH_BITS>
+void LZ77::hash_chain_parse_fixed(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy,
+                                  LZ77Sequences& output, int skip_trigger, int start) {
+    const int window = WINDOW_SIZE ? WINDOW_SIZE : window_size;
+    const int n = size;
+
+    // head holds the most recent position for each hash, prev links every position to the previous one with the same hash
+    // prev is a ring of at least window_size entries, an entry is only overwritten once its position is out of the window
+    int ring_size = 1;
+    while (ring_size < window && ring_size < n) ring_size <<= 1;
+    const int ring_mask = ring_size - 1;
+    // Both tables are kept between parses. Positions are stored as chain_base + pos, so anything below
+    // chain_base is from an earlier parse and reads as empty without clearing the tables
+    if (chain_head.size() != size_t(1) << HASH_BITS || chain_head.get_allocator() != TrackedAllocator<int>(memory) ||
+        chain_base > INT32_MAX - n) {
+        chain_head = TrackedVector<int>(size_t(1) << HASH_BITS, 0, TrackedAllocator<int>(memory));
+        chain_prev = TrackedVector<int>(TrackedAllocator<int>(memory));
+        chain_base = 1;
+    }
+    if (chain_prev.size() < size_t(ring_size)) chain_prev.resize(ring_size, 0);
+    int* head = chain_head.data();
+    int* prev = chain_prev.data();
+    const int base = chain_base;
+    chain_base += n;
+    output.reserve((n - start) / 4 + 16);
+    int next_insert = 0;
+    RepeatOffsets repeats;
+    size_t (*matchLength)(const unsigned char*, const unsigned char*, size_t) = Kernels::active().matchLength;
+
+    auto hashAt = [&](int pos) {
+        return hashBytes<MIN_MATCH, HASH_BITS>(input + pos);
+    };
+    auto insertUpTo = [&](int end) {
+        for (; next_insert < end && next_insert + MIN_MATCH <= n; ++next_insert) {
+            uint32_t h = hashAt(next_insert);
+            prev[next_insert & ring_mask] = head[h];
+            head[h] = base + next_insert;
+        }
+    };
+    auto findMatch = [&](int pos, int& best_distance) {
+        // Always leave one byte for the token's next character
+        int limit = min(n - pos - 1, int(UINT16_MAX));
+        int best_length = 0;
+        if (limit < MIN_MATCH) return 0;
+
+        // Recent offsets first, they are cheap to check and cheap to code
+        for (int r = 0; r < RepeatOffsets::COUNT; ++r) {
+            int distance = repeats.offsets[r];
+            if (distance > pos || distance > window) continue;
+            const unsigned char* candidate = input + pos - distance;
+            if (candidate[best_length] != input[pos + best_length]) continue;
+            int k = static_cast<int>(matchLength(candidate, input + pos, limit));
+            if (k > best_length) {
+                best_length = k;
+                best_distance = distance;
+            }
+        }
+        if (best_length >= MIN_MATCH && (best_length >= nice_length || best_length == limit)) return best_length;
+
+        int candidate = head[hashAt(pos)] - base;
+        DEFLATE_STAT(++finderStats.positionsSearched);
+        for (int depth = chain_depth; candidate >= 0 && pos - candidate <= window && depth > 0; --depth) {
+            DEFLATE_STAT(++finderStats.candidatesWalked);
+            // Checking the byte that would make this match longer rejects most candidates straight away
+            if (input[candidate + best_length] == input[pos + best_length]) {
+                int k = static_cast<int>(matchLength(input + candidate, input + pos, limit));
+                if (k > best_length) {
+                    best_length = k;
+                    best_distance = pos - candidate;
+                    if (k >= nice_length || k == limit) break;
+                }
+            }
+            candidate = prev[candidate & ring_mask] - base;
+        }
+        if (best_length < MIN_MATCH) {
+            // A literal token's offset is left at 0, anything else only costs bits
+            best_distance = 0;
+            return 0;
+        }
+        return best_length;
+    };
+
+    // The history before start is hashed by the first insertUpTo, matches into it are found like any other
+    int i = start;
+    int cached_pos = -1, cached_length = 0, cached_distance = 0;
+    int misses = 0; // Positions since the last match, for skip_trigger
+    while (i < n) {
+        insertUpTo(i);
+        int distance = 0;
+        int length;
+        if (cached_pos == i) {
+            length = cached_length;
+            distance = cached_distance;
+        } else {
+            length = findMatch(i, distance);
+        }
+
+        if (lazy && length > 0 && length < nice_length && i + 1 < n) {
+            insertUpTo(i + 1);
+            cached_pos = i + 1;
+            cached_distance = 0;
+            cached_length = findMatch(i + 1, cached_distance);
+            if (cached_length > length) {
+                // Emit this byte on its own and take the longer match from the next position
+                output.push(0, 0, input[i]);
+                ++i;
+                continue;
+            }
+        }
+
+        if (length > 0) {
+            repeats.use(distance);
+            misses = 0;
+        } else if (skip_trigger > 0) {
+            // Long runs without a match are likely incompressible, search them ever more sparsely
+            int step = 1 + (++misses >> skip_trigger);
+            for (int end = min(i + step, n); i + 1 < end;) output.push(0, 0, input[i++]);
+            next_insert = max(next_insert, i);
+        }
+        output.push(distance, length, input[i + length]);
+        i += length + 1;
+    }
+}
+
+void LZ77::release_tables() {
+    chain_head = TrackedVector<int>(TrackedAllocator<int>(memory));
+    chain_prev = TrackedVector<int>(TrackedAllocator<int>(memory));
+    chain_base = 0;
+}
+
+// The configurations the levels use, other windows run the WINDOW_SIZE 0 versions
+template <int MIN_MATCH, int HASH_BITS>
+LZ77::HashChainParser LZ77::hash_chain_parser(int window_size) {
+    switch (window_size) {
+        case 4096:  return &LZ77::hash_chain_parse_fixed<4096, MIN_MATCH, HASH_BITS>;
+        case 8192:  return &LZ77::hash_chain_parse_fixed<8192, MIN_MATCH, HASH_BITS>;
+        case 16384: return &LZ77::hash_chain_parse_fixed<16384, MIN_MATCH, HASH_BITS>;
+        case 32768: return &LZ77::hash_chain_parse_fixed<32768, MIN_MATCH, HASH_BITS>;
+        case 65532: return &LZ77::hash_chain_parse_fixed<65532, MIN_MATCH, HASH_BITS>;
+        default:    return &LZ77::hash_chain_parse_fixed<0, MIN_MATCH, HASH_BITS>;
+    }
+}
+
+template <int MIN_MATCH>
+LZ77::HashChainParser LZ77::hash_chain_parser(int window_size, int hash_bits) {
+    switch (hash_bits) {
+        case 12: return hash_chain_parser<MIN_MATCH, 12>(window_size);
+        case 15: return hash_chain_parser<MIN_MATCH, 15>(window_size);
+        case 16: return hash_chain_parser<MIN_MATCH, 16>(window_size);
+        default: throw std::runtime_error("Hash bits must be 12, 15 or 16");
+    }
+}
+
+LZ77::HashChainParser LZ77::hash_chain_parser(int window_size, int min_match, int hash_bits) {
+    switch (min_match) {
+        case 3: return hash_chain_parser<3>(window_size, hash_bits);
+        case 4: return hash_chain_parser<4>(window_size, hash_bits);
+        case 6: return hash_chain_parser<6>(window_size, hash_bits);
+        default: throw std::runtime_error("Minimum match must be 3, 4 or 6");
+    }
+}
+
 vector<unsigned char> LZ77::decompressToBytes(const vector<LZ77Token>& compressed) {
+    TRACE_SCOPE("lz77_expand");
     vector<unsigned char> output;
     for (const LZ77Token& token : compressed) {
         if (token.length > 0) {
             // Copy the match from the specified distance back in the output
+            // The match may overlap the bytes it produces (length > offset), which is how runs are coded
             int start = output.size() - token.offset;
-            if (start < 0 || token.length > output.size()) {
+            if (start < 0 || token.offset == 0) {
                 throw std::runtime_error("Invalid LZ77 token");
             }
             for (int i = 0; i < token.length; ++i) {
@@ -254,6 +455,42 @@ vector<unsigned char> LZ77::decompressToBytes(const vector<LZ77Token>& compresse
     return output;
 }
 
+vector<unsigned char> LZ77::decompressToBytes(const LZ77Sequences& sequences) {
+    return decompressToBytes(sequences, nullptr, 0);
+}
+
+vector<unsigned char> LZ77::decompressToBytes(const LZ77Sequences& sequences, const unsigned char* history, size_t historySize) {
+    TRACE_SCOPE("lz77_expand");
+    const size_t count = sequences.size();
+    const unsigned char* literals = sequences.literals.data();
+    const uint16_t* lengths = sequences.lengths.data();
+    const uint16_t* offsets = sequences.offsets.data();
+
+    // The copy kernel writes whole vectors, so it gets slack past the end that is trimmed afterwards. Decoding starts
+    // after a copy of the history, which is dropped once every match has been copied
+    const size_t decodedSize = historySize + sequences.decodedSize();
+    vector<unsigned char> output(decodedSize + Kernels::COPY_SLACK);
+    void (*copyMatch)(unsigned char*, size_t, size_t) = Kernels::active().copyMatch;
+    unsigned char* out = output.data();
+    if (historySize) memcpy(out, history, historySize);
+    size_t pos = historySize;
+    for (size_t t = 0; t < count; ++t) {
+        size_t length = lengths[t];
+        if (length > 0) {
+            size_t offset = offsets[t];
+            if (offset == 0 || offset > pos) {
+                throw std::runtime_error("Invalid LZ77 token");
+            }
+            copyMatch(out + pos, offset, length);
+            pos += length;
+        }
+        out[pos++] = literals[t];
+    }
+    output.resize(decodedSize);
+    output.erase(output.begin(), output.begin() + historySize);
+    return output;
+}
+
 void LZ77::decompressToFile(const vector<unsigned char>& compressedData, const string& filename) {
     vector<LZ77Token> tokens = byteStreamToTokens(compressedData);
 
@@ -264,11 +501,18 @@ void LZ77::decompressToFile(const vector<unsigned char>& compressedData, const s
 
 
 vector<unsigned char> LZ77::tokensToByteStream(const vector<LZ77Token>& tokens) {
+    return tokensToByteStream(tokens.data(), tokens.size());
+}
+
+vector<unsigned char> LZ77::tokensToByteStream(const LZ77Token* tokens, size_t count) {
+    TRACE_SCOPE("tokenize");
     //Create a vector to hold a bytestream (needed for huffman)
     vector<unsigned char> byteStream;
+    byteStream.reserve(count * 5);
 
     // Convert the LZ77 tokens to a byte stream
-    for (const LZ77Token& token : tokens) {
+    for (size_t t = 0; t < count; ++t) {
+        const LZ77Token& token = tokens[t];
         if (token.offset > UINT16_MAX || token.length > UINT16_MAX) {
             throw std::runtime_error("Offset or length too large for 16 bits");
         }
@@ -293,6 +537,7 @@ vector<unsigned char> LZ77::tokensToByteStream(const vector<LZ77Token>& tokens)
 
 
 vector<LZ77Token> LZ77::byteStreamToTokens(const vector<unsigned char>& byteStream) {
+    TRACE_SCOPE("detokenize");
     vector<LZ77Token> tokens;
 
     // Check if the size of the input vector is a multiple of 5
@@ -320,3 +565,90 @@ vector<LZ77Token> LZ77::byteStreamToTokens(const vector<unsigned char>& byteStre
     return tokens;
 }
 
+vector<unsigned char> LZ77::sequencesToByteStream(const LZ77Sequences& sequences) {
+    TRACE_SCOPE("tokenize");
+    const size_t count = sequences.size();
+    const unsigned char* literals = sequences.literals.data();
+    const uint16_t* lengths = sequences.lengths.data();
+    const uint16_t* offsets = sequences.offsets.data();
+
+    vector<unsigned char> byteStream(count * 5);
+    unsigned char* out = byteStream.data();
+    for (size_t t = 0; t < count; ++t, out += 5) {
+        out[0] = static_cast<unsigned char>(offsets[t] & 0xFF);
+        out[1] = static_cast<unsigned char>(offsets[t] >> 8);
+        out[2] = static_cast<unsigned char>(lengths[t] & 0xFF);
+        out[3] = static_cast<unsigned char>(lengths[t] >> 8);
+        out[4] = literals[t];
+    }
+    return byteStream;
+}
+
+void LZ77::byteStreamToSequences(const unsigned char* byteStream, size_t size, LZ77Sequences& sequences) {
+    TRACE_SCOPE("detokenize");
+    if (size % 5 != 0) {
+        throw std::runtime_error("Invalid byte stream size");
+    }
+    const size_t count = size / 5;
+    sequences.literals.resize(count);
+    sequences.lengths.resize(count);
+    sequences.offsets.resize(count);
+    unsigned char* literals = sequences.literals.data();
+    uint16_t* lengths = sequences.lengths.data();
+    uint16_t* offsets = sequences.offsets.data();
+    for (size_t t = 0; t < count; ++t, byteStream += 5) {
+        offsets[t] = static_cast<uint16_t>(byteStream[0] | (byteStream[1] << 8));
+        lengths[t] = static_cast<uint16_t>(byteStream[2] | (byteStream[3] << 8));
+        literals[t] = byteStream[4];
+    }
+}
+
+void LZ77Sequences::countBytes(uint32_t counts[256]) const {
+    const size_t count = size();
+    // Offsets and lengths are viewed as their little endian bytes, exactly as they are serialized
+    Kernels::active().histogram(literals.data(), count, counts);
+    for (size_t t = 0; t < count; ++t) {
+        ++counts[offsets[t] & 0xFF];
+        ++counts[offsets[t] >> 8];
+        ++counts[lengths[t] & 0xFF];
+        ++counts[lengths[t] >> 8];
+    }
+}
+
+size_t LZ77Sequences::encodeRepeatOffsets() {
+    RepeatOffsets repeats;
+    size_t used = 0;
+    const size_t count = size();
+    for (size_t t = 0; t < count; ++t) {
+        if (lengths[t] == 0) continue;
+        int offset = offsets[t];
+        int code = repeats.find(offset);
+        if (code) ++used;
+        if (!code && offset > UINT16_MAX - RepeatOffsets::COUNT) {
+            throw std::runtime_error("Offset too large for rep coding");
+        }
+        offsets[t] = static_cast<uint16_t>(code ? code : offset + RepeatOffsets::COUNT);
+        repeats.use(offset);
+    }
+    return used;
+}
+
+void LZ77Sequences::decodeRepeatOffsets() {
+    RepeatOffsets repeats;
+    const size_t count = size();
+    for (size_t t = 0; t < count; ++t) {
+        if (lengths[t] == 0) continue;
+        int value = offsets[t];
+        if (value == 0) throw std::runtime_error("Invalid LZ77 token");
+        int offset = value <= RepeatOffsets::COUNT ? repeats.offsets[value - 1] : value - RepeatOffsets::COUNT;
+        offsets[t] = static_cast<uint16_t>(offset);
+        repeats.use(offset);
+    }
+}
+
+size_t LZ77Sequences::decodedSize() const {
+    size_t total = size();
+    for (uint16_t length : lengths) total += length;
+    return total;
+}
+
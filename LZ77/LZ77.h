@@ -6,12 +6,20 @@
 #include <map>
 #include <deque>
 #include<xxhash.h>
+#include "Memory/Memory.h"
 #include <divsufsort.h>
 #include <divsufsort64.h>
 #include <sdsl/suffix_arrays.hpp>
 #include <sdsl/lcp.hpp>
 using namespace std;
 
+// Statistics counters are compiled in only with DEFLATE_STATS, so they cost nothing otherwise
+#ifdef DEFLATE_STATS
+#define DEFLATE_STAT(statement) statement
+#else
+#define DEFLATE_STAT(statement)
+#endif
+
 
 struct LZ77Token {
     uint16_t offset;
@@ -21,8 +29,76 @@ struct LZ77Token {
     LZ77Token(uint16_t offset, uint16_t length,unsigned char next) : offset(offset), length(length), next(next) {}
 };
 
+// The last few match offsets, most recent first, as both the parser and the rep code transform see them
+// A match at one of these is coded as its index + 1 instead of the offset, real offsets are stored + COUNT
+struct RepeatOffsets {
+    static const int COUNT = 3;
+    int offsets[COUNT] = {1, 4, 8};
+
+    // Rep code (1..COUNT) of offset, or 0 when it isn't one of them
+    int find(int offset) const {
+        for (int r = 0; r < COUNT; ++r) {
+            if (offsets[r] == offset) return r + 1;
+        }
+        return 0;
+    }
+    // Moves offset to the front, after a match at it
+    void use(int offset) {
+        int r = 0;
+        while (r < COUNT - 1 && offsets[r] != offset) ++r;
+        for (; r > 0; --r) offsets[r] = offsets[r - 1];
+        offsets[0] = offset;
+    }
+};
+
+// Structure of arrays form of a token list, the next byte, match length and offset of token i are
+// literals[i], lengths[i] and offsets[i], so every pass over the tokens is a loop over contiguous arrays
+struct LZ77Sequences {
+    TrackedVector<unsigned char> literals;
+    TrackedVector<uint16_t> lengths;
+    TrackedVector<uint16_t> offsets;
+
+    explicit LZ77Sequences(MemoryResource* memory = defaultMemoryResource())
+            : literals(TrackedAllocator<unsigned char>(memory)), lengths(TrackedAllocator<uint16_t>(memory)), offsets(TrackedAllocator<uint16_t>(memory)) {}
+
+    size_t size() const { return literals.size(); }
+    void reserve(size_t count) {
+        literals.reserve(count);
+        lengths.reserve(count);
+        offsets.reserve(count);
+    }
+    void push(uint16_t offset, uint16_t length, unsigned char next) {
+        offsets.push_back(offset);
+        lengths.push_back(length);
+        literals.push_back(next);
+    }
+    void clear() {
+        literals.clear();
+        lengths.clear();
+        offsets.clear();
+    }
+
+    // Byte histogram of the 5 byte per token stream, without building it
+    void countBytes(uint32_t counts[256]) const;
+    // Total decompressed size, every token is its match plus one byte
+    size_t decodedSize() const;
+
+    // Rewrite match offsets as rep codes and back, see RepeatOffsets. encode returns the number of rep codes used
+    size_t encodeRepeatOffsets();
+    void decodeRepeatOffsets();
+};
+
+// Work done by the hash chain finder, only counted with DEFLATE_STATS
+struct MatchFinderStats {
+    uint64_t positionsSearched = 0;
+    uint64_t candidatesWalked = 0;
+};
+
 class LZ77 {
 public:
+    MatchFinderStats finderStats;
+    MemoryResource* memory = defaultMemoryResource(); // Internal tables of the hash chain finder
+
     vector<unsigned char> loadFile(const string& filename);
     void saveFile(const string& filename, const vector<unsigned char>& byteStream);
     vector<unsigned char> compress(const vector<unsigned char>& input, int window_size);
@@ -31,8 +107,16 @@ public:
     vector<unsigned char> decompressToBytes(const vector<LZ77Token>& compressed);
     void decompressToFile(const vector<unsigned char>& compressedData, const string& filename);
     vector<unsigned char> tokensToByteStream(const vector<LZ77Token>& tokens);
+    vector<unsigned char> tokensToByteStream(const LZ77Token* tokens, size_t count);
     vector<LZ77Token> byteStreamToTokens(const vector<unsigned char>& byteStream);
 
+    // The same stream to and from sequences, both presize their output
+    vector<unsigned char> sequencesToByteStream(const LZ77Sequences& sequences);
+    void byteStreamToSequences(const unsigned char* byteStream, size_t size, LZ77Sequences& sequences);
+    vector<unsigned char> decompressToBytes(const LZ77Sequences& sequences);
+    // Same, with matches reaching back into history, the dictionary the sequences were parsed after
+    vector<unsigned char> decompressToBytes(const LZ77Sequences& sequences, const unsigned char* history, size_t historySize);
+
 
     pair<int, int> sa_binary_search(const sdsl::csa_wt<>& sa, const vector<unsigned char>& pattern, int current_position_in_data) {
         int left = 0;
@@ -81,5 +165,40 @@ public:
     }
 
     vector<unsigned char> rabin_karp_compress(const vector<unsigned char> &input, int window_size);
+
+    // Hash chain match finder, walks at most chain_depth candidates per position and stops early at nice_length
+    // With lazy set, a match is deferred by one byte when the next position has a longer one
+    // The last RepeatOffsets::COUNT offsets are tried before the chain, and win ties with it
+    vector<unsigned char> hash_chain_compress(const vector<unsigned char> &input, int window_size, int chain_depth, int nice_length, bool lazy);
+    vector<unsigned char> hash_chain_compress(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy);
+    // Same parse, appending to sequences rather than serializing
+    // min_match (3, 4 or 6) and hash_bits (12, 15 or 16) pick one of the compiled in versions, see hash_chain_parser
+    // With skip_trigger set, every 1 << skip_trigger positions without a match make the search step one byte longer,
+    // the positions stepped over go out as literals without being searched or hashed (LZ4's acceleration)
+    // input[0, start) is only history, a preset dictionary: it is hashed and matched into but not coded
+    void hash_chain_parse(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy,
+                          LZ77Sequences& sequences, int min_match = 3, int hash_bits = 15, int skip_trigger = 0, size_t start = 0);
+    // The hash chain tables stay allocated between parses, these report and free them
+    size_t table_bytes() const { return (chain_head.capacity() + chain_prev.capacity()) * sizeof(int); }
+    void release_tables();
+
+private:
+    // The hash chain parse with window, minimum match and hash width as constants, so the compiler can fold
+    // the hashing, bounds and window checks into the loops
+    template <int WINDOW_SIZE, int MIN_MATCH, int HASH_BITS>
+    void hash_chain_parse_fixed(const unsigned char* input, size_t size, int window_size, int chain_depth, int nice_length, bool lazy,
+                                LZ77Sequences& output, int skip_trigger, int start);
+
+    typedef void (LZ77::*HashChainParser)(const unsigned char*, size_t, int, int, int, bool, LZ77Sequences&, int, int);
+    template <int MIN_MATCH, int HASH_BITS>
+    static HashChainParser hash_chain_parser(int window_size);
+    template <int MIN_MATCH>
+    static HashChainParser hash_chain_parser(int window_size, int hash_bits);
+    static HashChainParser hash_chain_parser(int window_size, int min_match, int hash_bits);
+
+    // Hash chain tables, reused by every parse of this LZ77, see hash_chain_parse_fixed
+    TrackedVector<int> chain_head;
+    TrackedVector<int> chain_prev;
+    int chain_base = 0;
 };
 
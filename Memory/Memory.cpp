@@ -0,0 +1,46 @@
+#include "Memory.h"
+#include <new>
+
+class DefaultMemoryResource : public MemoryResource {
+public:
+    void* allocate(size_t bytes) override { return ::operator new(bytes); }
+    void deallocate(void* pointer, size_t) override { ::operator delete(pointer); }
+};
+
+MemoryResource* defaultMemoryResource() {
+    static DefaultMemoryResource resource;
+    return &resource;
+}
+
+TrackingMemoryResource::TrackingMemoryResource(MemoryResource* upstream)
+        : upstream(upstream), currentBytes(0), peakBytes(0) {}
+
+void* TrackingMemoryResource::allocate(size_t bytes) {
+    void* pointer = upstream->allocate(bytes);
+    count(bytes);
+    return pointer;
+}
+
+void TrackingMemoryResource::deallocate(void* pointer, size_t bytes) {
+    upstream->deallocate(pointer, bytes);
+    currentBytes.fetch_sub(bytes);
+}
+
+void TrackingMemoryResource::charge(size_t bytes) {
+    // Upstream didn't see this memory through allocate, so it is passed on
+    count(bytes);
+    upstream->charge(bytes);
+}
+
+void TrackingMemoryResource::release(size_t bytes) {
+    currentBytes.fetch_sub(bytes);
+    upstream->release(bytes);
+}
+
+void TrackingMemoryResource::count(size_t bytes) {
+    size_t now = currentBytes.fetch_add(bytes) + bytes;
+    size_t peak = peakBytes.load();
+    while (now > peak && !peakBytes.compare_exchange_weak(peak, now)) {
+        // peak is reloaded by the failed exchange
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+using namespace std;
+
+// Pluggable allocator interface for the library's internal buffers
+// charge/release account for memory a resource didn't allocate itself, like vectors returned by the
+// older std::vector based APIs, so a tracking resource still sees the whole working set
+class MemoryResource {
+public:
+    virtual ~MemoryResource() {}
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void deallocate(void* pointer, size_t bytes) = 0;
+    virtual void charge(size_t) {}
+    virtual void release(size_t) {}
+};
+
+// operator new/delete, shared by everything that isn't given a resource
+MemoryResource* defaultMemoryResource();
+
+// Passes allocations through to upstream while keeping the current and peak number of bytes in use
+class TrackingMemoryResource : public MemoryResource {
+public:
+    explicit TrackingMemoryResource(MemoryResource* upstream = defaultMemoryResource());
+
+    void* allocate(size_t bytes) override;
+    void deallocate(void* pointer, size_t bytes) override;
+    void charge(size_t bytes) override;
+    void release(size_t bytes) override;
+
+    size_t current() const { return currentBytes.load(); }
+    size_t peak() const { return peakBytes.load(); }
+
+private:
+    void count(size_t bytes);
+
+    MemoryResource* upstream;
+    atomic<size_t> currentBytes;
+    atomic<size_t> peakBytes;
+};
+
+// Charges a buffer for as long as it is alive
+class MemoryCharge {
+public:
+    MemoryCharge(MemoryResource* resource, size_t bytes) : resource(resource), bytes(bytes) { resource->charge(bytes); }
+    ~MemoryCharge() { resource->release(bytes); }
+    void resize(size_t newBytes) {
+        resource->charge(newBytes);
+        resource->release(bytes);
+        bytes = newBytes;
+    }
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+private:
+    MemoryResource* resource;
+    size_t bytes;
+};
+
+// Standard allocator over a MemoryResource, for containers that should be accounted for
+template <typename T>
+class TrackedAllocator {
+public:
+    typedef T value_type;
+    // A moved in container brings its resource along, so assigning a fresh vector switches the resource
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    TrackedAllocator(MemoryResource* resource = defaultMemoryResource()) : resource(resource) {}
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U>& other) : resource(other.resource) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(resource->allocate(n * sizeof(T))); }
+    void deallocate(T* pointer, size_t n) { resource->deallocate(pointer, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const TrackedAllocator<U>& other) const { return resource == other.resource; }
+    template <typename U>
+    bool operator!=(const TrackedAllocator<U>& other) const { return resource != other.resource; }
+
+    MemoryResource* resource;
+};
+
+template <typename T>
+using TrackedVector = vector<T, TrackedAllocator<T>>;
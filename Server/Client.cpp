@@ -0,0 +1,43 @@
+#include "Client.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Client::Client(const string& socketPath) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) throw std::runtime_error("Bad socket path '" + socketPath + "'");
+    strcpy(address.sun_path, socketPath.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error(string("Cannot create socket: ") + strerror(errno));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("Cannot connect to " + socketPath + ": " + error);
+    }
+}
+
+Client::~Client() {
+    close(fd);
+}
+
+vector<unsigned char> Client::compress(const unsigned char* data, size_t size, int level) {
+    return call(Op::Compress, level, data, size);
+}
+
+vector<unsigned char> Client::decompress(const unsigned char* data, size_t size) {
+    return call(Op::Decompress, 0, data, size);
+}
+
+vector<unsigned char> Client::call(Op op, int level, const unsigned char* data, size_t size) {
+    Protocol::writeRequest(fd, op, level, data, size);
+    unsigned char status;
+    vector<unsigned char> output;
+    if (!Protocol::readResponse(fd, status, output)) throw std::runtime_error("Server closed the connection");
+    if (status != Protocol::OK) throw std::runtime_error("Server error: " + string(output.begin(), output.end()));
+    return output;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Protocol.h"
+
+using namespace std;
+
+// One connection to a compression Server. Calls wait for their response, so a Client serves one thread at a time
+class Client {
+public:
+    // Connects, throws when nothing listens on socketPath
+    explicit Client(const string& socketPath);
+    ~Client();
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Throw with the server's message when it couldn't do the request
+    vector<unsigned char> compress(const unsigned char* data, size_t size, int level);
+    vector<unsigned char> decompress(const unsigned char* data, size_t size);
+
+private:
+    vector<unsigned char> call(Op op, int level, const unsigned char* data, size_t size);
+
+    int fd;
+};
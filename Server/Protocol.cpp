@@ -0,0 +1,102 @@
+#include "Protocol.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+const unsigned char Protocol::OK;
+const unsigned char Protocol::ERROR;
+const size_t Protocol::MAX_FRAME;
+
+// Reads exactly size bytes. False when the stream ends before the first of them
+static bool readAll(int fd, unsigned char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = recv(fd, data + done, size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error(string("Socket read failed: ") + strerror(errno));
+        if (n == 0) {
+            if (done == 0) return false;
+            throw std::runtime_error("Connection closed inside a frame");
+        }
+        done += n;
+    }
+    return true;
+}
+
+// MSG_NOSIGNAL, a closed peer is an error rather than a SIGPIPE
+static void writeAll(int fd, const unsigned char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = send(fd, data + done, size - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error(string("Socket write failed: ") + strerror(errno));
+        done += n;
+    }
+}
+
+// The size bytes of a frame body into data, grown as they arrive rather than all at once from the length, so a
+// header alone can't make the reader allocate a whole MAX_FRAME
+static void readBody(int fd, vector<unsigned char>& data, size_t size) {
+    static const size_t FIRST_READ = 64 << 10;
+    data.clear();
+    while (data.size() < size) {
+        size_t done = data.size();
+        size_t step = min(size - done, max(done, FIRST_READ));
+        data.resize(done + step);
+        if (!readAll(fd, data.data() + done, step)) throw std::runtime_error("Connection closed inside a frame");
+    }
+}
+
+// The length and the first header bytes of a frame, headerSize of them. False on a clean end of stream
+static bool readHeader(int fd, unsigned char* header, size_t headerSize, size_t& dataSize) {
+    unsigned char length[4];
+    if (!readAll(fd, length, 4)) return false;
+    size_t body = length[0] | (length[1] << 8) | (length[2] << 16) | (size_t(length[3]) << 24);
+    if (body < headerSize || body > Protocol::MAX_FRAME) throw std::runtime_error("Bad frame length " + to_string(body));
+    if (!readAll(fd, header, headerSize)) throw std::runtime_error("Connection closed inside a frame");
+    dataSize = body - headerSize;
+    return true;
+}
+
+static void writeFrame(int fd, const unsigned char* header, size_t headerSize, const unsigned char* data, size_t size) {
+    if (headerSize + size > Protocol::MAX_FRAME) throw std::runtime_error("Frame too large: " + to_string(headerSize + size) + " bytes");
+    uint32_t body = static_cast<uint32_t>(headerSize + size);
+    unsigned char prefix[8] = {static_cast<unsigned char>(body), static_cast<unsigned char>(body >> 8),
+                               static_cast<unsigned char>(body >> 16), static_cast<unsigned char>(body >> 24)};
+    memcpy(prefix + 4, header, headerSize);
+    writeAll(fd, prefix, 4 + headerSize);
+    writeAll(fd, data, size);
+}
+
+bool Protocol::readRequest(int fd, Request& request) {
+    unsigned char header[2];
+    size_t size;
+    if (!readHeader(fd, header, 2, size)) return false;
+    if (header[0] != static_cast<uint8_t>(Op::Compress) && header[0] != static_cast<uint8_t>(Op::Decompress)) {
+        throw std::runtime_error("Unknown request op " + to_string(header[0]));
+    }
+    request.op = static_cast<Op>(header[0]);
+    request.level = header[1];
+    readBody(fd, request.data, size);
+    return true;
+}
+
+void Protocol::writeRequest(int fd, Op op, int level, const unsigned char* data, size_t size) {
+    unsigned char header[2] = {static_cast<unsigned char>(op), static_cast<unsigned char>(level)};
+    writeFrame(fd, header, 2, data, size);
+}
+
+bool Protocol::readResponse(int fd, unsigned char& status, vector<unsigned char>& data) {
+    size_t size;
+    if (!readHeader(fd, &status, 1, size)) return false;
+    readBody(fd, data, size);
+    return true;
+}
+
+void Protocol::writeResponse(int fd, unsigned char status, const unsigned char* data, size_t size) {
+    writeFrame(fd, &status, 1, data, size);
+}
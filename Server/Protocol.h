@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Requests and responses of the compression daemon over a Unix stream socket, each a frame of
+//   uint32 length | body
+// with little endian integers and length counting the body. A request body is
+//   op | level | data
+// and a response body
+//   status | output, or the error message when status is ERROR
+// Requests on one connection are answered in order, one at a time
+enum class Op : uint8_t {
+    Compress = 1,
+    Decompress = 2
+};
+
+struct Request {
+    Op op;
+    uint8_t level; // Ignored by Decompress
+    vector<unsigned char> data;
+};
+
+class Protocol {
+public:
+    static const unsigned char OK = 0;
+    static const unsigned char ERROR = 1;
+    // Larger frames are refused, and a frame's buffer grows only as its bytes arrive, so a bad length can't make the
+    // reader allocate gigabytes
+    static const size_t MAX_FRAME = 1u << 30;
+
+    // False when the peer closed the connection before the frame, throws on a broken or truncated frame
+    static bool readRequest(int fd, Request& request);
+    static void writeRequest(int fd, Op op, int level, const unsigned char* data, size_t size);
+    static bool readResponse(int fd, unsigned char& status, vector<unsigned char>& data);
+    static void writeResponse(int fd, unsigned char status, const unsigned char* data, size_t size);
+};
@@ -0,0 +1,208 @@
+#include "Server.h"
+#include "Deflate/Deflate.h"
+#include "Trace/Trace.h"
+#include <thread>
+#include <future>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct Response {
+    unsigned char status;
+    vector<unsigned char> data;
+};
+
+struct Server::Job {
+    Request request;
+    promise<Response> response;
+};
+
+Server::Server(const ServerOptions& options) : options(options) {
+    if (this->options.threads <= 0) this->options.threads = max(1u, thread::hardware_concurrency());
+    this->options.maxBatch = max(this->options.maxBatch, size_t(1));
+    this->options.maxConnections = max(this->options.maxConnections, size_t(1));
+}
+
+Server::~Server() {
+    stop();
+}
+
+void Server::stop() {
+    stopping = true;
+    // Wakes the accept() in run()
+    int fd = listenFd.load();
+    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+    // And a run() waiting for a connection slot, under the lock so the wakeup can't fall between its check and wait
+    lock_guard<mutex> guard(connectionLock);
+    connectionSlot.notify_all();
+}
+
+ServerCounters Server::counters() const {
+    ServerCounters result;
+    result.connections = connectionCount;
+    result.requests = requestCount;
+    result.errors = errorCount;
+    result.batches = batchCount;
+    result.batchedRequests = batchedCount;
+    result.bytesIn = bytesIn;
+    result.bytesOut = bytesOut;
+    return result;
+}
+
+void Server::run() {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (options.socketPath.empty() || options.socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Bad socket path '" + options.socketPath + "'");
+    }
+    strcpy(address.sun_path, options.socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error(string("Cannot create socket: ") + strerror(errno));
+    unlink(options.socketPath.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("Cannot listen on " + options.socketPath + ": " + error);
+    }
+    listenFd = fd;
+    // A stop() before listenFd was set had nothing to shut down
+    if (stopping) shutdown(fd, SHUT_RDWR);
+
+    vector<thread> workers;
+    for (int i = 0; i < options.threads; ++i) workers.emplace_back(&Server::work, this);
+
+    while (!stopping) {
+        {
+            unique_lock<mutex> guard(connectionLock);
+            connectionSlot.wait(guard, [&]() { return connections.size() < options.maxConnections || stopping; });
+        }
+        if (stopping) break;
+        int connection = accept(fd, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!stopping) cerr << "accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        ++connectionCount;
+        lock_guard<mutex> guard(connectionLock);
+        connections.insert(connection);
+        thread(&Server::serve, this, connection).detach();
+    }
+
+    // Connections stop reading, finish the request in flight and close, then the workers drain the queue
+    {
+        unique_lock<mutex> guard(connectionLock);
+        for (int connection : connections) shutdown(connection, SHUT_RD);
+        connectionsClosed.wait(guard, [&]() { return connections.empty(); });
+    }
+    {
+        lock_guard<mutex> guard(queueLock);
+        draining = true;
+    }
+    queueReady.notify_all();
+    for (thread& worker : workers) worker.join();
+    listenFd = -1;
+    close(fd);
+    unlink(options.socketPath.c_str());
+}
+
+void Server::serve(int fd) {
+    try {
+        while (true) {
+            shared_ptr<Job> job = make_shared<Job>();
+            if (!Protocol::readRequest(fd, job->request)) break;
+            ++requestCount;
+            bytesIn += job->request.data.size();
+            future<Response> pending = job->response.get_future();
+            {
+                lock_guard<mutex> guard(queueLock);
+                queue.push_back(job);
+            }
+            // All of them, a worker holding a partial batch may only want some of what is queued
+            queueReady.notify_all();
+            Response response = pending.get();
+            bytesOut += response.data.size();
+            Protocol::writeResponse(fd, response.status, response.data.data(), response.data.size());
+        }
+    } catch (const std::exception& e) {
+        // A broken connection only ends that connection
+        if (!stopping) cerr << "connection: " << e.what() << endl;
+    }
+    close(fd);
+    lock_guard<mutex> guard(connectionLock);
+    connections.erase(fd);
+    connectionSlot.notify_all();
+    if (connections.empty()) connectionsClosed.notify_all();
+}
+
+bool Server::nextBatch(vector<shared_ptr<Job>>& batch) {
+    batch.clear();
+    unique_lock<mutex> guard(queueLock);
+    queueReady.wait(guard, [&]() { return !queue.empty() || draining; });
+    if (queue.empty()) return false;
+    batch.push_back(queue.front());
+    queue.pop_front();
+    const Request& first = batch.front()->request;
+    if (first.data.size() > options.smallRequest) return true;
+
+    auto like = [&](const shared_ptr<Job>& job) {
+        const Request& request = job->request;
+        return request.op == first.op && (request.op == Op::Decompress || request.level == first.level) &&
+               request.data.size() <= options.smallRequest;
+    };
+    auto deadline = chrono::steady_clock::now() + chrono::microseconds(options.batchDelayMicros);
+    while (batch.size() < options.maxBatch) {
+        auto it = find_if(queue.begin(), queue.end(), like);
+        if (it != queue.end()) {
+            batch.push_back(*it);
+            queue.erase(it);
+            continue;
+        }
+        if (draining || queueReady.wait_until(guard, deadline) == cv_status::timeout) break;
+    }
+    return true;
+}
+
+void Server::work() {
+    Deflate deflate;
+    CompressionContext compressContext;
+    DecompressionContext decompressContext;
+    vector<shared_ptr<Job>> batch;
+    while (nextBatch(batch)) {
+        TRACE_SCOPE("server_batch");
+        if (batch.size() > 1) {
+            ++batchCount;
+            batchedCount += batch.size();
+        }
+        for (const shared_ptr<Job>& job : batch) {
+            const Request& request = job->request;
+            Response response;
+            response.status = Protocol::OK;
+            try {
+                if (request.op == Op::Compress) {
+                    CompressionParams params = CompressionParams::fromLevel(request.level);
+                    params.threads = 1; // The pool already has a worker per thread
+                    response.data = deflate.compress(request.data, params, compressContext);
+                } else {
+                    // Checked up front so a small stream can't ask for an output no response can carry
+                    uint64_t size = Deflate::decompressedSize(request.data.data(), request.data.size());
+                    if (size > Protocol::MAX_FRAME - 1) throw std::runtime_error("Output of " + to_string(size) + " bytes is too large for a response");
+                    response.data = deflate.decompress(request.data, decompressContext);
+                }
+            } catch (const std::exception& e) {
+                ++errorCount;
+                string message = e.what();
+                response.status = Protocol::ERROR;
+                response.data.assign(message.begin(), message.end());
+            }
+            job->response.set_value(move(response));
+        }
+    }
+}
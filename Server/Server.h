@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "Protocol.h"
+
+using namespace std;
+
+struct ServerOptions {
+    string socketPath;
+    int threads = 0; // Worker threads, 0 for one per hardware thread
+    // Requests with at most this much data are small: a worker takes up to maxBatch of them with the same op and
+    // level off the queue at once and runs them back to back on its warm contexts
+    size_t smallRequest = 64 << 10;
+    size_t maxBatch = 32;
+    // How long a worker holding a partial batch waits for more small requests. 0 only coalesces what is already
+    // queued, more trades latency for larger batches under light load
+    int batchDelayMicros = 0;
+    // Connections served at once, each has a thread and up to a MAX_FRAME request. Further ones wait in the listen
+    // backlog until one closes
+    size_t maxConnections = 64;
+};
+
+struct ServerCounters {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t batches = 0; // Batches of more than one request
+    uint64_t batchedRequests = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+};
+
+// Long running compression service on a Unix domain socket (see Protocol.h), so short lived processes don't each
+// pay for thread and context setup. Each connection, up to maxConnections, has a thread that reads its requests and
+// queues them, a pool of workers, each with its own Deflate engine and contexts kept warm across requests, takes them
+// off the queue
+class Server {
+public:
+    explicit Server(const ServerOptions& options);
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Binds the socket, replacing a stale one, and serves until stop(). Queued requests are finished before it returns
+    void run();
+    // From any thread, not from a signal handler
+    void stop();
+    ServerCounters counters() const;
+
+private:
+    struct Job;
+
+    void serve(int fd);
+    void work();
+    // The next job and, when it is small, more small ones like it. False once stopping and the queue is empty
+    bool nextBatch(vector<shared_ptr<Job>>& batch);
+
+    ServerOptions options;
+    atomic<int> listenFd{-1};
+    atomic<bool> stopping{false};
+
+    mutex queueLock;
+    condition_variable queueReady;
+    deque<shared_ptr<Job>> queue;
+    bool draining = false;
+
+    mutex connectionLock;
+    condition_variable connectionsClosed;
+    condition_variable connectionSlot;
+    set<int> connections;
+
+    atomic<uint64_t> connectionCount{0}, requestCount{0}, errorCount{0}, batchCount{0}, batchedCount{0}, bytesIn{0}, bytesOut{0};
+};
@@ -0,0 +1,70 @@
+// Compression daemon, serves compress and decompress requests on a Unix socket until SIGINT or SIGTERM
+//
+// deflated --socket path [-p threads] [--max-batch 32] [--small-request 64K] [--batch-delay micros] [--max-connections 64]
+
+#include <iostream>
+#include <thread>
+#include <csignal>
+#include <pthread.h>
+#include "Server.h"
+
+using namespace std;
+
+static size_t parseSize(const string& text) {
+    size_t value = stoull(text);
+    switch (text.back()) {
+        case 'K': case 'k': return value << 10;
+        case 'M': case 'm': return value << 20;
+        default: return value;
+    }
+}
+
+int main(int argc, char** argv) {
+    ServerOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--socket") { options.socketPath = value; ++i; }
+        else if (arg == "-p" || arg == "--threads") { options.threads = stoi(value); ++i; }
+        else if (arg == "--max-batch") { options.maxBatch = stoull(value); ++i; }
+        else if (arg == "--small-request") { options.smallRequest = parseSize(value); ++i; }
+        else if (arg == "--batch-delay") { options.batchDelayMicros = stoi(value); ++i; }
+        else if (arg == "--max-connections") { options.maxConnections = stoull(value); ++i; }
+        else {
+            cerr << "Unknown argument: " << arg << endl;
+            return 2;
+        }
+    }
+    if (options.socketPath.empty()) {
+        cerr << "usage: deflated --socket path [-p threads] [--max-batch n] [--small-request size] [--batch-delay micros]\n"
+                "                [--max-connections n]" << endl;
+        return 2;
+    }
+
+    // Blocked before any thread starts, so only the waiter below sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    Server server(options);
+    thread waiter([&]() {
+        int signal;
+        sigwait(&signals, &signal);
+        server.stop();
+    });
+    waiter.detach();
+
+    try {
+        server.run();
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    ServerCounters counters = server.counters();
+    cerr << "connections: " << counters.connections << ", requests: " << counters.requests << ", errors: " << counters.errors
+         << ", batches: " << counters.batches << " (" << counters.batchedRequests << " requests)"
+         << ", in: " << counters.bytesIn << " bytes, out: " << counters.bytesOut << " bytes" << endl;
+    return 0;
+}
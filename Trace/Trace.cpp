@@ -0,0 +1,160 @@
+#include "Trace.h"
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+atomic<bool> Trace::active(false);
+
+static const size_t TRACE_CAPACITY = 1 << 14;
+
+// One event, guarded by a sequence number in the manner of a seqlock: odd while its thread writes it, 2 * index + 2
+// once event index is complete. Every field is atomic so dump() can read while the owner overwrites, and throws away
+// what changed under it
+struct TraceSlot {
+    atomic<uint64_t> sequence{0};
+    atomic<const char*> name{nullptr};
+    atomic<uint32_t> tid{0};
+    atomic<uint64_t> start{0};
+    atomic<uint64_t> duration{0};
+};
+
+// Single producer ring: only the owning thread writes slots and publishes head, dump() and clear() never block it.
+// clear() moves cleared up to head instead of touching anything the owner writes
+struct TraceBuffer {
+    TraceSlot slots[TRACE_CAPACITY];
+    atomic<uint64_t> head{0};
+    atomic<uint64_t> cleared{0};
+};
+
+static mutex registryMutex;
+static vector<unique_ptr<TraceBuffer>>& allBuffers() {
+    static vector<unique_ptr<TraceBuffer>> buffers;
+    return buffers;
+}
+static vector<TraceBuffer*>& freeBuffers() {
+    static vector<TraceBuffer*> buffers;
+    return buffers;
+}
+
+static uint64_t nowNanoseconds() {
+    static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+}
+
+// Owns the calling thread's buffer and gives it back for reuse when the thread exits
+struct ThreadTrace {
+    TraceBuffer* buffer = nullptr;
+    uint32_t tid;
+
+    ThreadTrace() {
+        static atomic<uint32_t> nextTid(1);
+        tid = nextTid++;
+    }
+    ~ThreadTrace() {
+        if (!buffer) return;
+        lock_guard<mutex> lock(registryMutex);
+        freeBuffers().push_back(buffer);
+    }
+    TraceBuffer* get() {
+        if (buffer) return buffer;
+        lock_guard<mutex> lock(registryMutex);
+        if (!freeBuffers().empty()) {
+            buffer = freeBuffers().back();
+            freeBuffers().pop_back();
+        } else {
+            allBuffers().push_back(unique_ptr<TraceBuffer>(new TraceBuffer()));
+            buffer = allBuffers().back().get();
+        }
+        return buffer;
+    }
+};
+
+static thread_local ThreadTrace threadTrace;
+
+uint64_t Trace::now() {
+    return nowNanoseconds();
+}
+
+void Trace::complete(const char* name, uint64_t start) {
+    uint64_t end = nowNanoseconds();
+    TraceBuffer* buffer = threadTrace.get();
+    uint64_t index = buffer->head.load(memory_order_relaxed);
+    TraceSlot& slot = buffer->slots[index % TRACE_CAPACITY];
+    slot.sequence.store(2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.name.store(name, memory_order_relaxed);
+    slot.tid.store(threadTrace.tid, memory_order_relaxed);
+    slot.start.store(start, memory_order_relaxed);
+    slot.duration.store(end - start, memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, memory_order_release);
+    buffer->head.store(index + 1, memory_order_release);
+}
+
+void Trace::enable(bool on) {
+    nowNanoseconds(); // Fix the epoch before the first event
+    active.store(on, memory_order_relaxed);
+}
+
+bool Trace::dump(const string& path) {
+    ofstream out(path);
+    if (!out) return false;
+    out.setf(ios::fixed);
+    out.precision(3);
+    // Copied out up to each buffer's published head. A slot its thread rewrote meanwhile is dropped, it was about to
+    // fall off the ring anyway. The file is written without holding any lock
+    vector<TraceEvent> events;
+    {
+        lock_guard<mutex> registryLock(registryMutex);
+        for (const auto& buffer : allBuffers()) {
+            uint64_t head = buffer->head.load(memory_order_acquire);
+            uint64_t first = max(buffer->cleared.load(memory_order_relaxed), head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0);
+            for (uint64_t i = first; i < head; ++i) {
+                const TraceSlot& slot = buffer->slots[i % TRACE_CAPACITY];
+                uint64_t sequence = slot.sequence.load(memory_order_acquire);
+                if (sequence != 2 * i + 2) continue;
+                TraceEvent event;
+                event.name = slot.name.load(memory_order_relaxed);
+                event.tid = slot.tid.load(memory_order_relaxed);
+                event.start = slot.start.load(memory_order_relaxed);
+                event.duration = slot.duration.load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                if (slot.sequence.load(memory_order_relaxed) == sequence) events.push_back(event);
+            }
+        }
+    }
+    out << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent& event = events[i];
+        out << (i ? ",\n" : "") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"ts\":" << event.start / 1000.0
+            << ",\"dur\":" << event.duration / 1000.0 << ",\"pid\":1,\"tid\":" << event.tid << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return static_cast<bool>(out);
+}
+
+void Trace::clear() {
+    lock_guard<mutex> lock(registryMutex);
+    for (const auto& buffer : allBuffers()) buffer->cleared.store(buffer->head.load(memory_order_acquire), memory_order_relaxed);
+}
+
+// DEFLATE_TRACE_FILE turns tracing on for the whole run and writes the trace at exit
+static void dumpAtExit() {
+    const char* path = getenv("DEFLATE_TRACE_FILE");
+    if (path) Trace::dump(path);
+}
+
+static bool enableFromEnvironment() {
+    if (!getenv("DEFLATE_TRACE_FILE")) return false;
+    Trace::enable(true);
+    // Construct the registries first so they are destroyed after dumpAtExit has run
+    allBuffers();
+    freeBuffers();
+    atexit(dumpAtExit);
+    return true;
+}
+
+static const bool tracingFromEnvironment = enableFromEnvironment();
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+// Lightweight scope tracing for the compression pipeline, written as Chrome/Perfetto trace_event JSON
+// Each scope is one complete ("X") event with its start and duration, so a wrapped buffer drops whole slices and
+// never leaves an end without its begin. Each thread records into its own fixed size, single producer ring buffer
+// without taking a lock; dump() reads up to the head each thread publishes and skips slots rewritten under it. Once
+// full, the oldest events are overwritten. Buffers of finished threads are handed to new ones, so thread churn
+// doesn't grow memory.
+//
+// Recording is compiled in with DEFLATE_TRACE and switched on at runtime with Trace::enable(), or by setting
+// DEFLATE_TRACE_FILE=path in the environment, which also dumps the trace to that path at exit.
+// Open the file in chrome://tracing or ui.perfetto.dev.
+
+struct TraceEvent {
+    const char* name; // Must be a string literal, only the pointer is stored
+    uint32_t tid;
+    uint64_t start;    // Nanoseconds since the trace epoch
+    uint64_t duration; // Nanoseconds
+};
+
+class Trace {
+public:
+    static void enable(bool on);
+    static bool enabled() { return active.load(memory_order_relaxed); }
+
+    // Nanoseconds since the trace epoch
+    static uint64_t now();
+    // Records a scope that started at start (from now()) and ends now
+    static void complete(const char* name, uint64_t start);
+
+    // Writes every recorded event, returns false if the file can't be written
+    static bool dump(const string& path);
+    static void clear();
+
+private:
+    static atomic<bool> active;
+};
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name(Trace::enabled() ? name : nullptr), start(this->name ? Trace::now() : 0) {}
+    ~TraceScope() {
+        if (name) Trace::complete(name, start);
+    }
+private:
+    const char* name;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#ifdef DEFLATE_TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
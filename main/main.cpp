@@ -116,8 +116,12 @@ void compress(string path, string outputFilename, int lz_cv, int hf_cv){
 
     unordered_map<unsigned char, string> huffmanCodes;
     vector<unsigned char> huffCompressed;
+    shared_ptr<const StaticHuffmanTable> staticTable;
     if(hf_cv ==0){
-        huffmanCodes = huff.generateHuffmanCodes(compressed);
+        // Small inputs are often cheaper with a pre-built table than with a tree plus its serialised codes
+        unordered_map<unsigned char, int> freq = huff.countBytes(compressed);
+        staticTable = huff.selectStaticTable(freq);
+        huffmanCodes = staticTable ? staticTable->codes : huff.generateHuffmanCodes(freq);
         cout << "Generated Huffman Codes" << endl;
         huffCompressed = huff.encode(compressed, huffmanCodes);
     }
@@ -128,7 +132,9 @@ void compress(string path, string outputFilename, int lz_cv, int hf_cv){
     }
 
     cout << "Huffman Encoded" << endl;
-    if (!huffmanCodes.empty() && !huffCompressed.empty()){
+    if (staticTable && !huffCompressed.empty()){
+        writeStaticCompressedData(outputFile, staticTable->id, huffCompressed);
+    }else if (!huffmanCodes.empty() && !huffCompressed.empty()){
         writeCompressedData(outputFile, huffmanCodes, huffCompressed);
     }else{
         cout << "EMPTY?!?!??!" << endl;
@@ -158,15 +164,26 @@ void decompress(string path, string outputFilename, int hf_dv){
     // std::vector<unsigned char> data(mmap.begin(), mmap.end());
     */
     // Get the data from the file
-    unordered_map<unsigned char, string> huffmanCodes = readHuffmanCodes(inputFile);
+    unsigned char tableId = 0;
+    unordered_map<unsigned char, string> huffmanCodes = readHuffmanCodes(inputFile, &tableId);
 
     vector<unsigned char> huffCompressed = readCompressedData(inputFile);
     vector<unsigned char> huffDecompressed;
     cout << "Beginning Decompression..." << endl;
-    if (hf_dv ==0){
+    if (hf_dv ==0 && tableId != 0){
+        // Static tables already have a flat decode table, no trie needed
+        shared_ptr<const StaticHuffmanTable> table = Huffman::findTable(tableId);
+        if (!table) {
+            cout << "Unknown static Huffman table: " << static_cast<int>(tableId) << endl;
+            return;
+        }
+        huffDecompressed = huff.decode(huffCompressed, table->decodeTable);
+    }
+    else if (hf_dv ==0){
         // Decompress the huffman encoding
         TrieNode* root = huff.buildTrie(huffmanCodes);
         huffDecompressed = huff.decode(huffCompressed, root);
+        Huffman::deleteTrie(root);
     }
     if (hf_dv==2){
         huffDecompressed = huff.deque_decode(huffCompressed, huffmanCodes);
@@ -185,6 +202,80 @@ void decompress(string path, string outputFilename, int hf_dv){
 
 }
 
+void deflateCompress(string path, string outputFilename, const CompressionParams& params){
+    //Memory Mapping
+    std::error_code error;
+    mio::mmap_source mmap(path, 0, mio::map_entire_file);
+    mmap.map(path, error);
+    if (error) {
+        std::cout << "Error mapping file: " << error.message() << std::endl;
+        return;
+    }
+    vector<unsigned char> data(mmap.data(), mmap.end());
+
+    Deflate deflate;
+    LZ77 lz;
+    CompressionStats stats;
+    lz.saveFile(outputFilename, deflate.compress(data, params, &stats));
+    cout << "Compressed File Saved" << endl;
+    DEFLATE_STAT(stats.print(cout));
+}
+
+void deflateDecompress(string path, string outputFilename){
+    Deflate deflate;
+    CompressionStats stats;
+    std::error_code error;
+    mio::mmap_source mmap;
+    mmap.map(path, error);
+    if (error) {
+        std::cout << "Error mapping file: " << error.message() << std::endl;
+        return;
+    }
+    // Decoded straight into the mapped output file
+    deflate.decompressToFile(reinterpret_cast<const unsigned char*>(mmap.data()), mmap.size(), outputFilename, 1, &stats);
+    cout << "Saved Output" << endl;
+    DEFLATE_STAT(stats.print(cout));
+}
+
+void deflateDeltaCompress(string path, string referencePath, string outputFilename, const CompressionParams& params){
+    // Both files are mapped, the reference is only read where the index and the copies point
+    std::error_code error;
+    mio::mmap_source input, reference;
+    input.map(path, error);
+    if (!error) reference.map(referencePath, error);
+    if (error) {
+        std::cout << "Error mapping file: " << error.message() << std::endl;
+        return;
+    }
+
+    Deflate deflate;
+    LZ77 lz;
+    CompressionStats stats;
+    lz.saveFile(outputFilename, deflate.compressDelta(reinterpret_cast<const unsigned char*>(input.data()), input.size(),
+                                                      reinterpret_cast<const unsigned char*>(reference.data()), reference.size(), params, &stats));
+    cout << "Delta Saved" << endl;
+    DEFLATE_STAT(stats.print(cout));
+}
+
+void deflateDeltaDecompress(string path, string referencePath, string outputFilename){
+    std::error_code error;
+    mio::mmap_source input, reference;
+    input.map(path, error);
+    if (!error) reference.map(referencePath, error);
+    if (error) {
+        std::cout << "Error mapping file: " << error.message() << std::endl;
+        return;
+    }
+
+    Deflate deflate;
+    LZ77 lz;
+    CompressionStats stats;
+    lz.saveFile(outputFilename, deflate.decompressDelta(reinterpret_cast<const unsigned char*>(input.data()), input.size(),
+                                                        reinterpret_cast<const unsigned char*>(reference.data()), reference.size(), 1, &stats));
+    cout << "Saved Output" << endl;
+    DEFLATE_STAT(stats.print(cout));
+}
+
 BENCHMARK(BM_Deflate);
 BENCHMARK_MAIN();
 
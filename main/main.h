@@ -8,6 +8,7 @@
 #include <benchmark/benchmark.h>
 #include <LZ77/LZ77.h>
 #include <Huffman/Huffman.h>
+#include <Deflate/Deflate.h>
 #include <cstring>
 #include <chrono>
 using namespace std;
@@ -51,11 +52,39 @@ void writeCompressedData(ofstream& outputFile, const unordered_map<unsigned char
     outputFile.write(reinterpret_cast<const char*>(&compressedData[0]), compressedData.size());
 }
 
-unordered_map<unsigned char, string> readHuffmanCodes(ifstream& inputFile){
+void writeStaticCompressedData(ofstream& outputFile, unsigned char tableId, const std::vector<unsigned char>& compressedData){
+    //An empty code table marks a static table, followed by the id both sides know it by
+    size_t size = 0;
+    outputFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    outputFile.write(reinterpret_cast<const char*>(&tableId), sizeof(tableId));
+
+    //Write the size of the compressed data
+    size = compressedData.size();
+    outputFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+
+    //Write the compressed data
+    outputFile.write(reinterpret_cast<const char*>(&compressedData[0]), compressedData.size());
+}
+
+unordered_map<unsigned char, string> readHuffmanCodes(ifstream& inputFile, unsigned char* tableId = nullptr){
     //Read the size of the huffman codes
     size_t size;
     inputFile.read(reinterpret_cast<char*>(&size), sizeof(size));
 
+    //No codes means a static table was used, look it up by id
+    if (size == 0) {
+        unsigned char id = 0;
+        inputFile.read(reinterpret_cast<char*>(&id), sizeof(id));
+        if (tableId) *tableId = id;
+        shared_ptr<const StaticHuffmanTable> table = Huffman::findTable(id);
+        if (!table) {
+            cout << "Unknown static Huffman table: " << static_cast<int>(id) << endl;
+            return {};
+        }
+        return table->codes;
+    }
+    if (tableId) *tableId = 0;
+
     //Read the huffman codes
     unordered_map<unsigned char, string> huffmanCodes;
     for (size_t i = 0; i < size; ++i){
@@ -175,11 +204,18 @@ void huffmanCompress(string path, string outputFilename, int cv){
     // Get the data from the memory mapped file
     vector<unsigned char> data(mmap.data(), mmap.end());
     if (cv==0){
-    unordered_map<unsigned char, string> huffmanCodes = huff.generateHuffmanCodes(data);
+    //Skip building a tree when a pre-built table is expected to come out smaller
+    unordered_map<unsigned char, int> freq = huff.countBytes(data);
+    shared_ptr<const StaticHuffmanTable> staticTable = huff.selectStaticTable(freq);
+    unordered_map<unsigned char, string> huffmanCodes = staticTable ? staticTable->codes : huff.generateHuffmanCodes(freq);
     cout << "Generated Huffman Codes" << endl;
     vector<unsigned char> huffCompressed = huff.encode(data, huffmanCodes);
     cout << "Huffman Encoded" << endl;
-    writeCompressedData(outputFile, huffmanCodes, huffCompressed);
+    if (staticTable) {
+        writeStaticCompressedData(outputFile, staticTable->id, huffCompressed);
+    } else {
+        writeCompressedData(outputFile, huffmanCodes, huffCompressed);
+    }
     cout << "Compressed File Saved" << endl;
     }
     if (cv ==2){
@@ -193,6 +229,11 @@ void huffmanCompress(string path, string outputFilename, int cv){
 
 }
 
+void deflateCompress(string path, string outputFilename, const CompressionParams& params);
+void deflateDecompress(string path, string outputFilename);
+void deflateDeltaCompress(string path, string referencePath, string outputFilename, const CompressionParams& params);
+void deflateDeltaDecompress(string path, string referencePath, string outputFilename);
+
 void decompress(string path, string outputFilename, int hf_dv);
 void LZ77decompress(string path, string outputFilename){
     LZ77 lz;
@@ -213,15 +254,28 @@ void huffmanDecompress(string path, string outputFilename, int dv){
     LZ77 lz;
     ifstream inputFile(path, ios::binary);
     // Get the data from the memory mapped file
-    unordered_map<unsigned char, string> huffmanCodes = readHuffmanCodes(inputFile);
+    unsigned char tableId = 0;
+    unordered_map<unsigned char, string> huffmanCodes = readHuffmanCodes(inputFile, &tableId);
     vector<unsigned char> huffCompressed = readCompressedData(inputFile);
 
     cout << "Beginning Decompression..." << endl;
     if (dv ==0){
-    // Build the trie from the Huffman codes
-    TrieNode* root = huff.buildTrie(huffmanCodes);
-    // Decompress the huffman encoding
-    vector<unsigned char> huffDecompressed = huff.decode(huffCompressed, root);
+    vector<unsigned char> huffDecompressed;
+    if (tableId != 0) {
+        // Static tables come with a ready-made decode table
+        shared_ptr<const StaticHuffmanTable> table = Huffman::findTable(tableId);
+        if (!table) {
+            cout << "Unknown static Huffman table: " << static_cast<int>(tableId) << endl;
+            return;
+        }
+        huffDecompressed = huff.decode(huffCompressed, table->decodeTable);
+    } else {
+        // Build the trie from the Huffman codes
+        TrieNode* root = huff.buildTrie(huffmanCodes);
+        // Decompress the huffman encoding
+        huffDecompressed = huff.decode(huffCompressed, root);
+        Huffman::deleteTrie(root);
+    }
     cout << "Huffman decoded" << endl;
     lz.saveFile(outputFilename, huffDecompressed);
     }